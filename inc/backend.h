@@ -6,6 +6,11 @@
 #ifndef UTCS356_ASSN4_INC_BACKEND_H_
 #define UTCS356_ASSN4_INC_BACKEND_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ut_tcp.h"
+
 /**
  * Launches the UTCS-TCP backend.
  *
@@ -13,4 +18,213 @@
  */
 void* begin_backend(void* in);
 
+/*
+ * Helpers used by the backend to access the send and receive streams.
+ */
+
+/**
+ * Moves the backend to its own copy of the socket when `ut_close` asks for a
+ * background close. The backend calls this on every loop iteration, without
+ * holding any socket lock, and continues with the returned socket.
+ *
+ * @param sock The socket the backend is running on.
+ *
+ * @return The socket the backend must use from now on.
+ */
+ut_socket_t* ut_backend_handoff(ut_socket_t* sock);
+
+/**
+ * Records that the FIN exchange is complete. The backend thread must return
+ * right after; the port moves to the shared reaper for TIME_WAIT and, for a
+ * background close, the socket is freed there too.
+ *
+ * @param sock The socket the backend is running on.
+ */
+void ut_backend_finish(ut_socket_t* sock);
+
+/**
+ * Frees the buffers owned by a socket, leaving its UDP socket open.
+ *
+ * @param sock The socket.
+ */
+void ut_free_state(ut_socket_t* sock);
+
+/**
+ * Appends bytes to the send ring, sleeping while it is full, and publishes
+ * them to the backend. The ring has a single producer: call with
+ * `write_lock` held.
+ *
+ * @param sock The socket to write to.
+ * @param buf The bytes.
+ * @param len The number of bytes.
+ */
+void ut_send_put(ut_socket_t* sock, const uint8_t* buf, uint32_t len);
+
+/**
+ * Publishes received data to the application by advancing
+ * `recv_win.next_expect`, waking the reader only if it is asleep. The data
+ * must already be in the ring.
+ *
+ * @param sock The socket.
+ * @param next_expect The new first missing sequence number.
+ */
+void ut_recv_publish(ut_socket_t* sock, uint32_t next_expect);
+
+/**
+ * Stores a received payload in the receive ring.
+ *
+ * The payload is placed at the slots for its sequence numbers, so it can be
+ * stored as soon as it arrives, in or out of order. Publishing it with
+ * `ut_recv_publish` is left to the caller. Bytes outside the
+ * receive window are not stored, nor are bytes already published: the
+ * reader may be copying those out.
+ *
+ * @param sock The socket that received the payload.
+ * @param seq Sequence number of the first payload byte.
+ * @param payload The payload.
+ * @param len The payload length.
+ *
+ * @return The number of bytes stored.
+ */
+uint32_t ut_recv_store(ut_socket_t* sock, uint32_t seq, const uint8_t* payload,
+                       uint32_t len);
+
+/**
+ * Gets the header length of the packets sent on a socket, including the
+ * extensions negotiated for the connection.
+ *
+ * @param sock The socket.
+ *
+ * @return The header length.
+ */
+uint16_t ut_hlen(ut_socket_t* sock);
+
+/**
+ * Gets the checksum flag to set on an outgoing SYN or SYN-ACK. An initiator
+ * offers checksums on its SYN when it wants them. A listener echoes the
+ * offer on its SYN-ACK only once `ut_csum_negotiate` enabled them. A
+ * handshake packet that carries the flag also carries the checksum
+ * extension, filled in with `set_checksum`.
+ *
+ * @param sock The socket.
+ *
+ * @return `CSUM_FLAG_MASK` or 0.
+ */
+uint8_t ut_csum_offer(ut_socket_t* sock);
+
+/**
+ * Settles checksum negotiation from the flags of the peer's SYN (on a
+ * listener) or SYN-ACK (on an initiator). Checksums are enabled only when
+ * this side wants them and the peer offered or echoed them.
+ *
+ * @param sock The socket.
+ * @param flags The flags of the received handshake packet.
+ */
+void ut_csum_negotiate(ut_socket_t* sock, uint8_t flags);
+
+/**
+ * Gets the maximum payload that fits in a packet sent on a socket.
+ *
+ * @param sock The socket.
+ *
+ * @return The effective maximum segment size.
+ */
+uint16_t ut_mss(ut_socket_t* sock);
+
+/**
+ * Clamps a retransmission timeout to the bounds configured for a socket.
+ *
+ * @param sock The socket.
+ * @param rto The timeout in ms.
+ *
+ * @return The timeout to use, in ms.
+ */
+uint32_t ut_rto_clamp(ut_socket_t* sock, uint32_t rto);
+
+/**
+ * Computes the window to advertise to the peer.
+ *
+ * Bytes lent by `ut_recv_zc` keep occupying the ring until released.
+ *
+ * @param sock The socket whose receive ring is inspected.
+ *
+ * @return The number of bytes the peer may send beyond `next_expect`.
+ */
+uint16_t ut_recv_window(ut_socket_t* sock);
+
+/**
+ * Copies queued send data into a segment payload.
+ *
+ * Bytes written with `ut_write` are copied from `sending_buf`, bytes queued
+ * with `ut_sendfile` are read straight from their file. Must be called with
+ * `send_lock` held, and only for bytes before `send_win.last_write`.
+ *
+ * @param sock The socket whose send stream is read.
+ * @param seq Sequence number of the first byte to copy.
+ * @param dst Destination, usually the payload of the segment being built.
+ * @param len The number of bytes to copy.
+ *
+ * @return The number of bytes copied, or -1 if a file read failed.
+ */
+int ut_send_fetch(ut_socket_t* sock, uint32_t seq, uint8_t* dst, uint32_t len);
+
+/**
+ * Releases send data that the peer has acknowledged, waking a writer waiting
+ * for space in the send ring. The newly acknowledged bytes grow the
+ * congestion window through `ut_cc_on_ack`.
+ *
+ * Must be called with `send_lock` held.
+ *
+ * @param sock The socket whose send stream is trimmed.
+ * @param ack Every byte before this sequence number is released. Ignored if
+ *            it is after `send_win.last_sent + 1`, since the peer cannot
+ *            acknowledge more than was sent.
+ */
+void ut_send_release(ut_socket_t* sock, uint32_t ack);
+
+/**
+ * Counts an ACK that acknowledges nothing new. The UT_DUP_ACK_THRESHOLD-th
+ * in a row reports a loss to `ut_cc_on_loss`; `ut_send_release` resets the
+ * count.
+ *
+ * @param sock The socket that received the ACK.
+ *
+ * @return true if the oldest unacknowledged segment should be retransmitted
+ *         now.
+ */
+bool ut_send_dup_ack(ut_socket_t* sock);
+
+/**
+ * Decides whether to acknowledge a received data segment at once, following
+ * `opts.ack_policy`. With UT_ACK_DELAYED, an in-order segment is held until a
+ * second one arrives or `opts.ack_delay` ms pass. A segment that arrives out
+ * of order, or fills a hole, is always acknowledged at once so the sender
+ * can recover quickly.
+ *
+ * @param sock The socket that received the segment.
+ * @param in_order Whether the segment was the next expected one and no
+ *                 out-of-order data is buffered behind it.
+ *
+ * @return true if an ACK should be sent now.
+ */
+bool ut_ack_on_data(ut_socket_t* sock, bool in_order);
+
+/**
+ * Checks whether a held ACK is due. The backend calls this on every loop
+ * iteration.
+ *
+ * @param sock The socket.
+ *
+ * @return true if an ACK should be sent now.
+ */
+bool ut_ack_timer_due(ut_socket_t* sock);
+
+/**
+ * Records that an ACK went out, on its own or on a data segment, so no held
+ * ACK is pending any more.
+ *
+ * @param sock The socket.
+ */
+void ut_ack_sent(ut_socket_t* sock);
+
 #endif  // UTCS356_ASSN4_INC_BACKEND_H_
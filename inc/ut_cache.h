@@ -0,0 +1,95 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_CACHE_H_
+#define UTCS356_ASSN4_INC_UT_CACHE_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cached path state older than this is not used to seed new connections.
+#define CACHE_EXPIRY 600  // s
+
+// A cached congestion window seeds a new connection with at most this many
+// initial windows.
+#define CACHE_MAX_WINDOW_SCALE 4
+
+/**
+ * What a previous connection to a destination learned about the path, kept
+ * process-wide so new connections can start where the last one left off.
+ * Setting UT_TCP_CACHE_FILE to a path also keeps it across processes;
+ * processes sharing the file merge their entries into it, and the most
+ * recently updated entry for a destination wins.
+ */
+typedef struct {
+  struct sockaddr_in addr;
+  uint32_t srtt;       // Smoothed RTT in ms, 0 if never measured.
+  uint32_t cong_win;   // Congestion window when the connection closed.
+  uint32_t slow_start_thresh;
+  uint64_t cookie;     // Fast-open cookie issued by the listener.
+  bool have_cookie;
+  bool have_metrics;
+  int64_t updated;     // CLOCK_REALTIME seconds of the last update.
+} ut_cache_entry_t;
+
+/**
+ * Looks up the cached state of a destination.
+ *
+ * @param addr The destination.
+ * @param entry Set to the cached state, if any.
+ *
+ * @return 1 if the destination has unexpired state, 0 otherwise.
+ */
+int ut_cache_lookup(const struct sockaddr_in* addr, ut_cache_entry_t* entry);
+
+/**
+ * Records the path metrics of a connection, typically when it closes.
+ *
+ * @param addr The destination.
+ * @param srtt Smoothed RTT in ms, or 0 to keep the cached one.
+ * @param cong_win Congestion window.
+ * @param slow_start_thresh Slow start threshold.
+ */
+void ut_cache_update(const struct sockaddr_in* addr, uint32_t srtt,
+                     uint32_t cong_win, uint32_t slow_start_thresh);
+
+/**
+ * Records the fast-open cookie a listener returned in its SYN-ACK.
+ *
+ * @param addr The listener.
+ * @param cookie The cookie.
+ */
+void ut_cache_set_cookie(const struct sockaddr_in* addr, uint64_t cookie);
+
+/**
+ * Forgets the fast-open cookie of a listener, e.g. after it rejected it.
+ *
+ * @param addr The listener.
+ */
+void ut_cache_clear_cookie(const struct sockaddr_in* addr);
+
+/**
+ * Generates the fast-open cookie for a client. Cookies are a keyed hash of
+ * the client address under a per-process secret, so the listener does not
+ * store them.
+ *
+ * @param addr The client.
+ *
+ * @return The cookie.
+ */
+uint64_t ut_cookie_generate(const struct sockaddr_in* addr);
+
+/**
+ * Checks a fast-open cookie presented on a SYN.
+ *
+ * @param addr The client.
+ * @param cookie The cookie from the SYN.
+ *
+ * @return 1 if data on the SYN may be accepted, 0 otherwise.
+ */
+int ut_cookie_check(const struct sockaddr_in* addr, uint64_t cookie);
+
+#endif  // UTCS356_ASSN4_INC_UT_CACHE_H_
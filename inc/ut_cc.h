@@ -0,0 +1,45 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_CC_H_
+#define UTCS356_ASSN4_INC_UT_CC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ut_tcp.h"
+
+/*
+ * Congestion control. ACKs and losses are reported here and the algorithm
+ * chosen with `opts.cc` updates `cong_win` and `slow_start_thresh`.
+ * `ut_send_release` and `ut_stream_ack` report newly acknowledged bytes, and
+ * `ut_send_dup_ack` reports a loss found by duplicate ACKs. The backend
+ * calls `ut_cc_on_loss` itself when a retransmission timer expires.
+ *
+ * Both algorithms share slow start. In congestion avoidance, Reno grows the
+ * window by one MSS per round trip and halves it on loss. CUBIC (RFC 8312)
+ * grows it along a cubic curve centered on the window at the last loss and
+ * only backs off to 70%, which keeps long fat pipes full.
+ */
+
+/**
+ * Grows the congestion window for newly acknowledged data.
+ *
+ * @param sock The socket.
+ * @param acked The number of bytes the ACK newly acknowledged.
+ */
+void ut_cc_on_ack(ut_socket_t* sock, uint32_t acked);
+
+/**
+ * Shrinks the congestion window after a loss.
+ *
+ * @param sock The socket.
+ * @param timeout Whether the loss was detected by a retransmission timeout
+ *                rather than duplicate ACKs; the window then restarts from
+ *                one MSS.
+ */
+void ut_cc_on_loss(ut_socket_t* sock, bool timeout);
+
+#endif  // UTCS356_ASSN4_INC_UT_CC_H_
@@ -0,0 +1,58 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_CPU_H_
+#define UTCS356_ASSN4_INC_UT_CPU_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Size of a cache line. Fields written by different threads are kept this
+// far apart so they do not share a line.
+#define UT_CACHELINE 64
+
+/**
+ * Picks the CPU for the next backend thread.
+ *
+ * CPUs are taken from the `UT_TCP_CPUS` environment variable, a list such as
+ * "2,3,8-11", and handed out round-robin so each new socket gets the next
+ * one.
+ *
+ * @return The CPU to pin to, or -1 to let the thread float.
+ */
+int ut_cpu_pick(void);
+
+/**
+ * Sets thread attributes that start a thread pinned to a CPU.
+ *
+ * @param attr Initialized thread attributes.
+ * @param cpu The CPU, or -1 to leave `attr` unchanged.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int ut_cpu_bind_attr(pthread_attr_t* attr, int cpu);
+
+/**
+ * Allocates zeroed memory on the NUMA node of a CPU.
+ *
+ * The pages are mapped fresh, given a memory policy that prefers the CPU's
+ * node, and committed at once. The calling thread's affinity is left alone.
+ *
+ * @param size The number of bytes.
+ * @param cpu The CPU whose node should hold the memory, or -1 for any node.
+ *
+ * @return The memory, to be released with `ut_cpu_free`, or NULL on error.
+ */
+void* ut_cpu_alloc(size_t size, int cpu);
+
+/**
+ * Releases memory allocated with `ut_cpu_alloc`.
+ *
+ * @param ptr The memory, or NULL.
+ * @param size The size it was allocated with.
+ */
+void ut_cpu_free(void* ptr, size_t size);
+
+#endif  // UTCS356_ASSN4_INC_UT_CPU_H_
@@ -7,7 +7,20 @@
 #ifndef UTCS356_ASSN4_INC_UTCS_PACKET_H_
 #define UTCS356_ASSN4_INC_UTCS_PACKET_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+// Network to host order conversions that always inline, unlike ntohl/ntohs
+// in unoptimized builds.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define UT_NTOH32(x) __builtin_bswap32(x)
+#define UT_NTOH16(x) __builtin_bswap16(x)
+#else
+#define UT_NTOH32(x) (x)
+#define UT_NTOH16(x) (x)
+#endif
 
 typedef struct {
   uint32_t identifier;         // Identifier for the UTCS-TCP protocol.
@@ -24,12 +37,51 @@ typedef struct {
 #define SYN_FLAG_MASK 0x8
 #define ACK_FLAG_MASK 0x4
 #define FIN_FLAG_MASK 0x2
+// The packet carries a CRC32C in the CSUM_EXT_LEN bytes after the header.
+// Sent on the SYN (and SYN-ACK) to negotiate checksums for the connection.
+#define CSUM_FLAG_MASK 0x10
+#define CSUM_EXT_LEN 4
+// The packet carries stream data. A 2-byte stream ID and the 4-byte offset of
+// the payload within that stream follow the header (and checksum, if any).
+// Stream data has its own offset space: the sequence number is not used. A
+// stream packet without payload acknowledges stream data instead: its offset
+// is the first byte the receiver is missing and its window is the stream's.
+#define STREAM_FLAG_MASK 0x20
+#define STREAM_EXT_LEN 6
+// The SYN (or SYN-ACK) carries an 8-byte fast-open cookie after the other
+// extensions. A zero cookie on a SYN requests one; a valid cookie lets the
+// listener accept the SYN's payload before the handshake completes.
+#define COOKIE_FLAG_MASK 0x40
+#define COOKIE_EXT_LEN 8
+// A path MTU probe, padded to the size being probed; see ut_pmtu.h. With
+// ACK_FLAG_MASK it is the reply, whose acknowledgement number is the probe's
+// sequence number, a probe ID rather than a position in the stream.
+#define PROBE_FLAG_MASK 0x80
 #define IDENTIFIER 51085  // Identifier for the UTCS-TCP protocol (Our course's unique number).
 
-// Maximum Segment Size. Make sure to update this if your CCA requires extension
-// data for all packets, as this reduces the payload and thus the MSS.
+// Maximum Segment Size at the default MTU. Make sure to update this if your CCA
+// requires extension data for all packets, as this reduces the payload and thus
+// the MSS. A socket's actual MSS follows its configured MTU; see `ut_mss`.
 #define MSS (MAX_LEN - sizeof(ut_tcp_header_t))
 
+/**
+ * A header converted to host byte order with naturally aligned fields.
+ *
+ * The first 16 bytes deliberately mirror the wire layout so they can be
+ * byte-swapped as a single vector.
+ */
+typedef struct {
+  uint32_t identifier;
+  uint16_t source_port;
+  uint16_t destination_port;
+  uint32_t seq_num;
+  uint32_t ack_num;
+  uint16_t hlen;
+  uint16_t plen;
+  uint16_t advertised_window;
+  uint8_t flags;
+} ut_tcp_header_host_t;
+
 /* Helper functions to get/set fields in the header */
 
 uint16_t get_src(ut_tcp_header_t* header);
@@ -71,7 +123,7 @@ void set_header(ut_tcp_header_t* header, uint16_t src, uint16_t dst,
                 uint8_t flags, uint16_t adv_window);
 
 /**
- * Gets a pointer to the packet payload.
+ * Gets a pointer to the packet payload, which starts `hlen` bytes in.
  *
  * @param pkt The packet to get the payload.
  *
@@ -117,6 +169,175 @@ uint8_t* create_packet(uint16_t src, uint16_t dst, uint32_t seq, uint32_t ack,
                        uint16_t hlen, uint16_t plen, uint8_t flags,
                        uint16_t adv_window, uint8_t* payload, uint16_t payload_len);
 
+/**
+ * Decodes the header fields after the first 16 bytes: hlen, plen, flags and
+ * the advertised window.
+ *
+ * @param pkt The packet whose header is decoded.
+ * @param out The decoded header.
+ */
+static inline void decode_header_tail(const uint8_t* pkt,
+                                      ut_tcp_header_host_t* out) {
+  uint16_t tail[2];
+  uint16_t adv;
+  memcpy(tail, pkt + 16, 4);
+  memcpy(&adv, pkt + 21, 2);
+  out->hlen = UT_NTOH16(tail[0]);
+  out->plen = UT_NTOH16(tail[1]);
+  out->flags = pkt[20];
+  out->advertised_window = UT_NTOH16(adv);
+}
+
+/**
+ * Decodes a whole header into host byte order in one step.
+ *
+ * Prefer this over the individual getters when several fields are needed.
+ * `pkt` does not need to be aligned. `validate_packets` uses an equivalent
+ * SSSE3 version when the CPU supports it.
+ *
+ * @param pkt The packet whose header is decoded.
+ * @param out The decoded header.
+ */
+static inline void decode_header(const uint8_t* pkt, ut_tcp_header_host_t* out) {
+  uint32_t w32[4];
+  uint16_t w16[2];
+  memcpy(w32, pkt, 4);
+  memcpy(w16, pkt + 4, 4);
+  memcpy(w32 + 2, pkt + 8, 8);
+  out->identifier = UT_NTOH32(w32[0]);
+  out->source_port = UT_NTOH16(w16[0]);
+  out->destination_port = UT_NTOH16(w16[1]);
+  out->seq_num = UT_NTOH32(w32[2]);
+  out->ack_num = UT_NTOH32(w32[3]);
+  decode_header_tail(pkt, out);
+}
+
+/**
+ * Decodes and validates a batch of received datagrams, such as the ones
+ * returned by a single `recvmmsg` call.
+ *
+ * A datagram is valid if it holds a full header with the UTCS-TCP
+ * identifier, `hlen` is at least the header size and at most `plen`, `plen`
+ * matches the datagram length, the destination port is `port`, `hlen`
+ * covers every extension announced in the flags, and its checksum, if it
+ * carries one, matches. If `require_csum` is set, it must carry one.
+ *
+ * @param pkts The datagrams.
+ * @param lens The length of each datagram, as received.
+ * @param n The number of datagrams.
+ * @param port The expected destination port.
+ * @param require_csum Drop datagrams without a checksum. The backend passes
+ *                     the socket's `csum_enabled`.
+ * @param hdrs Filled with the decoded header of every valid datagram.
+ * @param valid Set to 1 for every valid datagram and 0 otherwise.
+ * @param csum_drops Incremented for every datagram that passes the other
+ *                   checks but fails its checksum, or lacks one that is
+ *                   required. The backend passes the socket's
+ *                   `csum_drops`. May be NULL.
+ *
+ * @return The number of valid datagrams.
+ */
+int validate_packets(uint8_t* const* pkts, const uint32_t* lens, int n,
+                     uint16_t port, bool require_csum,
+                     ut_tcp_header_host_t* hdrs, uint8_t* valid,
+                     uint64_t* csum_drops);
+
+/**
+ * Gets the offset of the stream extension in a packet with the given flags.
+ *
+ * @param flags The packet flags.
+ *
+ * @return The offset, in bytes, from the start of the packet.
+ */
+static inline uint16_t stream_ext_offset(uint8_t flags) {
+  return sizeof(ut_tcp_header_t) +
+         ((flags & CSUM_FLAG_MASK) ? CSUM_EXT_LEN : 0);
+}
+
+/**
+ * Gets the offset of the cookie extension in a packet with the given flags.
+ *
+ * @param flags The packet flags.
+ *
+ * @return The offset, in bytes, from the start of the packet.
+ */
+static inline uint16_t cookie_ext_offset(uint8_t flags) {
+  return stream_ext_offset(flags) +
+         ((flags & STREAM_FLAG_MASK) ? STREAM_EXT_LEN : 0);
+}
+
+/**
+ * Fills in the cookie extension of a packet that has `COOKIE_FLAG_MASK` set.
+ *
+ * @param pkt The packet.
+ * @param cookie The cookie, or 0 to request one.
+ */
+void set_cookie(uint8_t* pkt, uint64_t cookie);
+
+/**
+ * Reads the cookie extension of a packet that has `COOKIE_FLAG_MASK` set.
+ *
+ * @param pkt The packet, whose `hlen` must already be validated to cover the
+ *            extension.
+ *
+ * @return The cookie.
+ */
+uint64_t get_cookie(uint8_t* pkt);
+
+/**
+ * Fills in the stream extension of a packet that has `STREAM_FLAG_MASK` set.
+ *
+ * @param pkt The packet.
+ * @param stream_id The stream the payload belongs to.
+ * @param stream_off Offset of the first payload byte within the stream.
+ */
+void set_stream(uint8_t* pkt, uint16_t stream_id, uint32_t stream_off);
+
+/**
+ * Reads the stream extension of a packet that has `STREAM_FLAG_MASK` set.
+ *
+ * @param pkt The packet, whose `hlen` must already be validated to cover the
+ *            extension.
+ * @param stream_id Set to the stream the payload belongs to.
+ * @param stream_off Set to the offset of the first payload byte within the
+ *                   stream.
+ */
+void get_stream(uint8_t* pkt, uint16_t* stream_id, uint32_t* stream_off);
+
+/**
+ * Computes a CRC32C (Castagnoli), using the SSE4.2 `crc32` instruction when
+ * the CPU supports it.
+ *
+ * @param crc The CRC of the preceding data, or 0 to start a new CRC.
+ * @param buf The data.
+ * @param len The length of the data.
+ *
+ * @return The updated CRC.
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t* buf, size_t len);
+
+/**
+ * Fills in the checksum of a packet that has `CSUM_FLAG_MASK` set.
+ *
+ * The checksum covers the header and the payload, but not the checksum
+ * itself. Call it after every other field and the payload are final.
+ *
+ * @param pkt The packet, with `hlen` of at least the header size plus
+ *            `CSUM_EXT_LEN`.
+ */
+void set_checksum(uint8_t* pkt);
+
+/**
+ * Verifies the checksum of a packet.
+ *
+ * @param pkt The packet, whose `hlen` and `plen` must already be validated
+ *            against the received length.
+ *
+ * @return 1 if the packet has no checksum or the checksum matches, 0 if the
+ *         packet is corrupted.
+ */
+int verify_checksum(uint8_t* pkt);
+
 /**
  * Checks if a given sequence number comes before another sequence number.
  *
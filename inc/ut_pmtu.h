@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_PMTU_H_
+#define UTCS356_ASSN4_INC_UT_PMTU_H_
+
+#include <stdint.h>
+
+#include "ut_tcp.h"
+
+/*
+ * Packetization layer path MTU discovery, in the style of RFC 8899.
+ *
+ * Probing is off unless `opts.max_mtu` is set above `opts.mtu`, e.g. with
+ * UT_TCP_MAX_MTU=9000 inside a jumbo-frame rack.
+ *
+ * A connection starts at `opts.mtu`. Once it is established, the backend
+ * sends probe packets, padded to a candidate MTU, that carry no data and are
+ * never retransmitted. The peer acknowledges each probe it receives, and
+ * the connection's packet size grows to the probed MTU. If a probe is lost
+ * PMTU_MAX_PROBES times, the search narrows below it. The first probe goes
+ * straight to `opts.max_mtu`, so a jumbo-frame path is found in one round
+ * trip. Otherwise a binary search follows. Once the search converges it is
+ * retried every PMTU_RAISE_TIMER ms in case the path has grown.
+ *
+ * Only probes are sent with DF set, using IP_PMTUDISC_PROBE, so the kernel
+ * rejects one larger than the interface MTU at once. Data packets keep the
+ * kernel's default: if the path later shrinks, they are fragmented instead
+ * of black-holed until `ut_pmtu_fall_back` brings them back to `opts.mtu`.
+ */
+
+// Transmissions of one probe size before it is considered too big.
+#define PMTU_MAX_PROBES 3
+
+// The search stops when the bounds are this close.
+#define PMTU_GRANULARITY 64
+
+// How long a converged search waits before probing for a larger MTU again.
+#define PMTU_RAISE_TIMER 600000  // ms
+
+/**
+ * Sets up path MTU discovery for a new socket.
+ *
+ * @param sock The socket, with its UDP socket and options in place.
+ */
+void ut_pmtu_init(ut_socket_t* sock);
+
+/**
+ * Sends the next probe, or retires a lost one, when one is due. The backend
+ * calls this on every loop iteration once the connection is established.
+ *
+ * @param sock The socket.
+ */
+void ut_pmtu_tick(ut_socket_t* sock);
+
+/**
+ * Handles a received probe or probe acknowledgement. The backend passes
+ * every valid packet here before processing it, and drops the packet if it
+ * was consumed: probe padding is not stream data and a probe ACK does not
+ * acknowledge any.
+ *
+ * @param sock The socket that received the packet.
+ * @param pkt The packet.
+ *
+ * @return 1 if the packet was a probe or probe ACK, 0 otherwise.
+ */
+int ut_pmtu_on_packet(ut_socket_t* sock, uint8_t* pkt);
+
+/**
+ * Drops back to `opts.mtu` after the path stopped carrying full-sized
+ * packets. The backend calls this when `sendto` fails with EMSGSIZE, or when
+ * full-sized segments keep timing out while smaller ones get through.
+ *
+ * @param sock The socket.
+ */
+void ut_pmtu_fall_back(ut_socket_t* sock);
+
+#endif  // UTCS356_ASSN4_INC_UT_PMTU_H_
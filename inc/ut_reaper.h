@@ -0,0 +1,32 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_REAPER_H_
+#define UTCS356_ASSN4_INC_UT_REAPER_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "ut_tcp.h"
+
+/**
+ * Hands a closed connection to the shared reaper thread for TIME_WAIT.
+ *
+ * For TIME_WAIT_TIMEOUT ms the reaper answers any retransmitted FIN on `fd`
+ * with the final ACK, then closes `fd` and frees `owned`. One reaper thread
+ * serves every connection in the process, so closed connections hold no
+ * thread of their own.
+ *
+ * @param fd The connection's UDP socket.
+ * @param peer The peer's address.
+ * @param my_port The local port.
+ * @param seq Sequence number for the final ACK (one past our FIN).
+ * @param ack Acknowledgement number for the final ACK (one past their FIN).
+ * @param owned A detached socket to free once TIME_WAIT ends, or NULL.
+ */
+void ut_reaper_add(int fd, const struct sockaddr_in* peer, uint16_t my_port,
+                   uint32_t seq, uint32_t ack, ut_socket_t* owned);
+
+#endif  // UTCS356_ASSN4_INC_UT_REAPER_H_
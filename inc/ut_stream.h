@@ -0,0 +1,159 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_STREAM_H_
+#define UTCS356_ASSN4_INC_UT_STREAM_H_
+
+#include <stdint.h>
+
+#include "ut_tcp.h"
+
+/*
+ * Independent streams multiplexed on one UTCS-TCP connection.
+ *
+ * All streams share the connection's handshake, congestion window and UDP
+ * socket. Each stream has its own offset space, send and receive rings,
+ * cumulative acknowledgement and window. A lost segment therefore only
+ * delays its own stream, and stream data neither appears in nor takes space
+ * from the connection's byte stream. Stream 0 is the connection's plain byte
+ * stream (`ut_read`/`ut_write`). The functions below take IDs from 1 to
+ * UT_MAX_STREAMS. Streams are opened implicitly by the first write or read.
+ */
+
+// Highest stream ID. Every stream the peer opens costs a receive ring, so
+// packets for higher IDs are dropped.
+#define UT_MAX_STREAMS 16
+
+/**
+ * Writes data to a stream, waiting for the peer to acknowledge earlier data
+ * when the stream's send ring is full. Writes from several threads are
+ * serialized. A write of at most the receive buffer size is never
+ * interleaved with another write to the same stream; a larger one may be.
+ *
+ * @param sock The socket to write to.
+ * @param stream_id The stream to write to.
+ * @param buf The data to write.
+ * @param length The number of bytes to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int ut_stream_write(ut_socket_t* sock, uint16_t stream_id, const void* buf,
+                    int length);
+
+/**
+ * Reads data from a stream.
+ *
+ * @param sock The socket to read from.
+ * @param stream_id The stream to read from.
+ * @param buf The buffer to read into.
+ * @param length The maximum number of bytes to read.
+ * @param flags Flags that determine how the socket should wait for data.
+ *
+ * @return The number of bytes read on success, -1 on error.
+ */
+int ut_stream_read(ut_socket_t* sock, uint16_t stream_id, void* buf,
+                   int length, ut_read_mode_t flags);
+
+/*
+ * Helpers used by the backend.
+ */
+
+/**
+ * Takes the next stream data to send. Streams with data inside the window
+ * the peer advertised take turns. The backend sends the bytes as one segment
+ * with `STREAM_FLAG_MASK` set. Since the segment is cut when it is sent,
+ * `max_len` can follow the current MSS. Must be called with `send_lock`
+ * held.
+ *
+ * @param sock The socket.
+ * @param max_len The most bytes to take, at most the MSS less
+ *                `STREAM_EXT_LEN`.
+ * @param stream_id Set to the stream the bytes belong to.
+ * @param stream_off Set to the stream offset of the first byte.
+ * @param dst Filled with the bytes.
+ *
+ * @return The number of bytes taken, 0 if no stream has data to send.
+ */
+uint32_t ut_stream_next(ut_socket_t* sock, uint32_t max_len,
+                        uint16_t* stream_id, uint32_t* stream_off,
+                        uint8_t* dst);
+
+/**
+ * Handles a stream acknowledgement: a stream packet without payload. Frees
+ * the acknowledged bytes, wakes writers waiting for space, grows the
+ * congestion window and records the stream's window. Must be called with
+ * `send_lock` held.
+ *
+ * @param sock The socket.
+ * @param stream_id The stream from the packet's stream extension.
+ * @param ack The offset from the packet's stream extension: the first byte
+ *            the peer is missing. Ignored if it is beyond what was sent.
+ * @param window The packet's advertised window.
+ */
+void ut_stream_ack(ut_socket_t* sock, uint16_t stream_id, uint32_t ack,
+                   uint16_t window);
+
+/**
+ * Rewinds every stream to its first unacknowledged byte after a
+ * retransmission timeout, so `ut_stream_next` sends that data again. Must be
+ * called with `send_lock` held.
+ *
+ * @param sock The socket.
+ */
+void ut_stream_rewind(ut_socket_t* sock);
+
+/**
+ * Gets the stream bytes sent but not yet acknowledged. They count against
+ * the congestion window, and the backend sends its FIN only once this is 0.
+ * Must be called with `send_lock` held.
+ *
+ * @param sock The socket.
+ *
+ * @return The number of bytes in flight over all streams.
+ */
+uint32_t ut_stream_in_flight(ut_socket_t* sock);
+
+/**
+ * Places a received stream payload in its stream, whether or not earlier
+ * segments have arrived. Must be called with `recv_lock` held; broadcast
+ * `wait_cond` afterwards, since readers of several streams may be waiting
+ * on it. If the payload was accepted, the backend answers with a stream
+ * acknowledgement built from `ut_stream_ack_info`.
+ *
+ * @param sock The socket.
+ * @param stream_id The stream the payload belongs to.
+ * @param stream_off Offset of the first payload byte within the stream.
+ * @param payload The payload.
+ * @param len The payload length.
+ *
+ * @return `len` if the payload was accepted, 0 if the stream ID is out of
+ *         range or the payload does not fit in the stream's receive ring.
+ */
+uint32_t ut_stream_deliver(ut_socket_t* sock, uint16_t stream_id,
+                           uint32_t stream_off, const uint8_t* payload,
+                           uint32_t len);
+
+/**
+ * Gets what a stream acknowledgement should carry. Must be called with
+ * `recv_lock` held.
+ *
+ * @param sock The socket.
+ * @param stream_id The stream.
+ * @param ack Set to the first stream offset not yet received in order.
+ * @param window Set to the space left in the stream's receive ring.
+ *
+ * @return 0 on success, -1 if no data was received on the stream.
+ */
+int ut_stream_ack_info(ut_socket_t* sock, uint16_t stream_id, uint32_t* ack,
+                       uint16_t* window);
+
+/**
+ * Frees every stream of a socket.
+ *
+ * @param sock The socket.
+ */
+void ut_stream_free_all(ut_socket_t* sock);
+
+#endif  // UTCS356_ASSN4_INC_UT_STREAM_H_
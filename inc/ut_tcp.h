@@ -8,11 +8,15 @@
 
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include "ut_cpu.h"
 #include "ut_packet.h"
 #include "grading.h"
 
@@ -20,18 +24,185 @@
 #define EXIT_ERROR -1
 #define EXIT_FAILURE 1
 
+// Default size of the send buffer. Writers block when it is full.
+#define UT_DEFAULT_SEND_BUF (1 << 20)
+
+// IPv4 and UDP header bytes in front of every packet.
+#define UT_IP_UDP_OVERHEAD 28
+
+// Range of path MTUs a socket may be configured with. The upper bound covers
+// jumbo frames.
+#define UT_MTU_MIN 576
+#define UT_MTU_MAX 9216
+
+// Largest packet, header included, that any socket may send. Receive buffers
+// must be at least this large.
+#define UT_MAX_PACKET (UT_MTU_MAX - UT_IP_UDP_OVERHEAD)
+
+// Messages sent with `ut_send_msg` are framed by a big-endian length prefix.
+// A whole message must fit in the receiver's `recv_buf` to be delivered;
+// the receiver skips one that does not.
+#define UT_MSG_HDR_LEN 4
+
+// Linger value that makes `ut_close` return at once and finish in the
+// background. This is the default.
+#define UT_LINGER_BACKGROUND -1
+
+// How long a background `ut_close` waits for the backend to take over the
+// connection before it waits for the backend to finish instead.
+#define UT_HANDOFF_TIMEOUT (2 * DEFAULT_TIMEOUT)  // ms
+
+// How often `ut_close` checks that the backend thread is still running.
+#define UT_CLOSE_POLL 20  // ms
+
+// Duplicate ACKs that signal a lost segment and trigger a fast retransmit.
+#define UT_DUP_ACK_THRESHOLD 3
+
+// How long a closed connection keeps its port to re-acknowledge a
+// retransmitted FIN. Scaled to our RTO rather than the minutes of TCP's 2MSL.
+#define TIME_WAIT_TIMEOUT (10 * DEFAULT_TIMEOUT)  // ms
+
+/*
+ * The application and the backend exchange data through single-producer,
+ * single-consumer rings. Each index is written by one side only and
+ * published with release semantics, so neither side takes a lock on the
+ * data path; locks and condition variables are only used to sleep. Indices
+ * written by different sides sit on different cache lines.
+ */
+
+/**
+ * When the receiver acknowledges data.
+ */
+typedef enum {
+  UT_ACK_IMMEDIATE = 0,  // Acknowledge every segment as it arrives.
+  UT_ACK_DELAYED,        // Acknowledge every other segment, or after `ack_delay` ms.
+} ut_ack_policy_t;
+
+/**
+ * Congestion control algorithms. See ut_cc.h.
+ */
+typedef enum {
+  UT_CC_RENO = 0,
+  UT_CC_CUBIC,
+} ut_cc_algo_t;
+
+/**
+ * Tunables of a UTCS-TCP socket. `ut_socket_opts_init` fills in defaults,
+ * which come from grading.h unless overridden by environment variables. A
+ * variable outside the range `ut_socket_ex` accepts is ignored.
+ */
+typedef struct {
+  uint32_t mtu;          // Path MTU to start from; packets are at most mtu - UT_IP_UDP_OVERHEAD bytes. UT_TCP_MTU.
+  uint32_t max_mtu;      // Largest path MTU to probe for. Defaults to `mtu`, which turns probing off. UT_TCP_MAX_MTU.
+  uint32_t init_window;  // Initial congestion window in bytes, 0 to scale WINDOW_INITIAL_WINDOW_SIZE to the MSS. UT_TCP_INIT_WINDOW.
+  uint32_t ssthresh;     // Initial slow start threshold in bytes, 0 to scale WINDOW_INITIAL_SSTHRESH to the MSS. UT_TCP_SSTHRESH.
+  uint32_t recv_buf;     // Receive buffer in bytes, from max_mtu - UT_IP_UDP_OVERHEAD to MAX_NETWORK_BUFFER. UT_TCP_RECV_BUF.
+  uint32_t send_buf;     // Send buffer in bytes, rounded up to a power of two. UT_TCP_SEND_BUF.
+  uint32_t rto_min;      // Lower bound on the retransmission timeout in ms. UT_TCP_RTO_MIN.
+  uint32_t rto_max;      // Upper bound on the retransmission timeout in ms. UT_TCP_RTO_MAX.
+  ut_ack_policy_t ack_policy;  // UT_TCP_ACK=immediate|delayed.
+  uint32_t ack_delay;          // Longest a delayed ACK is held, in ms. UT_TCP_ACK_DELAY.
+  ut_cc_algo_t cc;             // UT_TCP_CC=reno|cubic.
+  bool checksum;  // Offer (or accept) payload checksums. UT_TCP_CHECKSUM.
+  int cpu;        // CPU to pin the backend to, or -1. Taken from UT_TCP_CPUS.
+} ut_socket_opts_t;
+
 typedef struct {
   uint32_t last_ack;
   uint32_t last_sent;
-  uint32_t last_write;
+  _Alignas(UT_CACHELINE) _Atomic uint32_t last_write;  // Published by the application.
 } send_win_t;
 
+/**
+ * A file region queued for transmission by `ut_sendfile`. The bytes are not
+ * copied into `sending_buf`; the backend reads them from `fd` when it builds
+ * (or rebuilds) a segment that covers them.
+ */
+typedef struct ut_send_region {
+  int fd;                       // Private duplicate of the caller's descriptor.
+  off_t offset;                 // File offset of the first byte still queued.
+  uint32_t seq;                 // Sequence number of the first byte still queued.
+  uint32_t len;                 // Number of bytes still queued.
+  struct ut_send_region* next;
+} ut_send_region_t;
+
+/**
+ * Send-side state of a stream. Streams have their own offset space and
+ * window, so stream data takes no connection sequence numbers. Guarded by
+ * `send_lock`.
+ */
+typedef struct ut_stream_tx {
+  uint16_t id;
+  uint8_t* buf;        // Ring of `recv_ring_size` bytes, indexed by stream offset, from `ut_cpu_alloc`.
+  uint32_t next_off;   // Stream offset of the next byte written.
+  uint32_t next_send;  // Stream offset of the next byte the backend sends.
+  uint32_t sent_max;   // One past the highest stream offset sent; `next_send` rewinds below it.
+  uint32_t acked;      // Stream offset of the first byte not yet acknowledged.
+  uint32_t peer_win;   // Window the peer last advertised for this stream.
+  struct ut_stream_tx* next;
+} ut_stream_tx_t;
+
+/**
+ * Receive-side state of a stream. Each stream has its own receive ring,
+ * indexed by stream offset, so a hole in one stream does not hold back data
+ * of the others.
+ */
+typedef struct ut_stream_rx {
+  uint16_t id;
+  uint8_t* buf;          // Ring of `recv_ring_size` bytes, from `ut_cpu_alloc`.
+  uint64_t* present;     // One bit per ring slot received beyond next_expect.
+  uint32_t next_read;    // Stream offset of the next byte to read.
+  uint32_t next_expect;  // Stream offset of the first missing byte.
+  uint32_t recv_max;     // One past the highest stream offset received.
+  struct ut_stream_rx* next;
+} ut_stream_rx_t;
+
+/**
+ * How far the connection has gotten in closing.
+ */
+typedef enum {
+  UT_OPEN = 0,
+  UT_TIME_WAIT,  // FINs exchanged; only a retransmitted FIN can still arrive.
+} ut_close_state_t;
+
 typedef struct {
-  uint32_t last_read;
-  uint32_t next_expect;
+  _Alignas(UT_CACHELINE) _Atomic uint32_t last_read;    // Published by the application.
+  _Alignas(UT_CACHELINE) _Atomic uint32_t next_expect;  // Published by the backend.
   uint32_t last_recv;
 } recv_win_t;
 
+/**
+ * Copies `len` bytes starting at position `pos` out of a ring of `size`
+ * bytes, a power of two.
+ */
+static inline void ring_copy_out(const uint8_t* ring, uint32_t size,
+                                 uint32_t pos, uint8_t* dst, uint32_t len) {
+  uint32_t start = pos & (size - 1);
+  uint32_t first = size - start;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(dst, ring + start, first);
+  memcpy(dst + first, ring, len - first);
+}
+
+/**
+ * Copies `len` bytes into a ring of `size` bytes, a power of two, at
+ * positions `pos` onwards.
+ */
+static inline void ring_copy_in(uint8_t* ring, uint32_t size, uint32_t pos,
+                                const uint8_t* src, uint32_t len) {
+  uint32_t start = pos & (size - 1);
+  uint32_t first = size - start;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(ring + start, src, first);
+  memcpy(ring, src + first, len - first);
+}
+
 /**
  * UTCS-TCP socket types. (DO NOT CHANGE.)
  */
@@ -43,43 +214,186 @@ typedef enum {
 /**
  * This structure holds the state of a socket. You may modify this structure as
  * you see fit to include any additional state you need for your implementation.
+ *
+ * Fields are grouped by the thread that writes them, and each group starts on
+ * its own cache line, so the application and the backend do not keep stealing
+ * lines from each other. The struct is therefore aligned to UT_CACHELINE,
+ * more than `malloc` guarantees: allocate it statically, on the stack, or
+ * with `aligned_alloc(UT_CACHELINE, sizeof(ut_socket_t))`.
  */
 typedef struct {
+  /* Set up by `ut_socket` and only read afterwards. */
   int socket;
   pthread_t thread_id;
   uint16_t my_port;
   struct sockaddr_in conn;
+  ut_socket_type_t type;
+  ut_socket_opts_t opts;
+  uint32_t recv_ring_size;  // A power of two above `opts.recv_buf`.
+  uint32_t send_ring_size;  // A power of two, at least `opts.send_buf`.
+  uint8_t* received_buf;  // Ring of `recv_ring_size` bytes indexed by sequence number.
+  uint8_t* sending_buf;   // Ring of `send_ring_size` bytes written with ut_write.
 
-  uint8_t* received_buf;
-  uint32_t received_len;
-  pthread_mutex_t recv_lock;
-
-  pthread_cond_t wait_cond;
-
-  uint8_t* sending_buf;
-  uint32_t sending_len;
-  pthread_mutex_t send_lock;
+  /* Written by the application. */
+  _Alignas(UT_CACHELINE) _Atomic uint32_t sending_head;  // Ring bytes ever written.
+  int32_t recv_msg_len;      // Body length of the message at the head of the ring, -1 until its prefix arrives.
+  uint32_t recv_msg_skip;    // Body bytes of a rejected message still to be dropped.
+  atomic_bool recv_waiting;  // The application sleeps on wait_cond.
+  atomic_bool send_waiting;  // The application sleeps on send_cond for space.
+  pthread_mutex_t write_lock;  // Keeps the send ring to one producer among application threads.
+  pthread_mutex_t read_lock;   // Keeps the receive ring to one consumer among application threads.
 
-  ut_socket_type_t type;
-  int dying;
-  pthread_mutex_t death_lock;
+  /* Written by the backend. */
+  _Alignas(UT_CACHELINE) _Atomic uint32_t sending_tail;  // Ring bytes ever released.
+  _Atomic uint32_t max_len;  // Largest packet sent, header included. Grows with path MTU discovery; read by `ut_mss`.
+  uint32_t sending_seq;  // Sequence number of the oldest unreleased byte.
+  send_win_t send_win;
+  recv_win_t recv_win;
+  uint32_t cong_win;
+  uint32_t send_adv_win;
+  uint32_t slow_start_thresh;
+  uint32_t send_fin_seq;
+  uint32_t recv_fin_seq;
+  uint32_t dup_ack_count;
+  uint32_t ack_pending;   // In-order segments received since the last ACK went out.
+  int64_t ack_deadline;   // CLOCK_MONOTONIC ms a delayed ACK is due, 0 if none is held.
+  uint64_t csum_drops;  // Received packets dropped for a bad or missing checksum.
+  uint32_t srtt;        // Smoothed RTT in ms, 0 until measured.
+  uint32_t cc_w_max;    // CUBIC: window in bytes before the last reduction.
+  uint32_t cc_k;        // CUBIC: ms from the epoch until the window is back at cc_w_max.
+  int64_t cc_epoch;     // CUBIC: CLOCK_MONOTONIC ms the current epoch began, 0 if none.
+  uint32_t pmtu_lo;          // Largest MTU known to work.
+  uint32_t pmtu_hi;          // Smallest MTU known not to, or opts.max_mtu + 1.
+  uint32_t pmtu_probe;       // MTU of the probe in flight, 0 if none.
+  uint32_t pmtu_probe_id;    // Sequence number of the last probe sent.
+  uint32_t pmtu_probe_count; // Probes sent for the size in flight.
+  int64_t pmtu_probe_sent;   // CLOCK_MONOTONIC ms the last probe was sent.
+  int64_t pmtu_next;         // CLOCK_MONOTONIC ms to search again, 0 if not scheduled.
 
   bool complete_init; // Indicates whether the socket has completed initialization.
   bool send_syn;      // Specifies whether to send a SYN packet for initialization.
   bool recv_fin;      // Indicates whether a FIN packet has been received from the peer.
   bool fin_acked;     // Indicates whether a previously sent FIN packet has been acknowledged.
+  bool csum_wanted;   // Offer (or accept) payload checksums during the handshake.
+  bool csum_enabled;  // Both sides agreed on checksums; every packet carries one.
+  bool fast_open;     // A cookie for the listener is cached; send data on the SYN.
+  uint64_t cookie;    // Fast-open cookie to present on the SYN, 0 to request one.
 
-  uint32_t send_fin_seq;
-  uint32_t recv_fin_seq;
-  uint32_t dup_ack_count;
+  ut_stream_rx_t* recv_streams;
+  ut_send_region_t* send_regions;
+  ut_send_region_t* send_regions_tail;
+  ut_stream_tx_t* send_streams;
+  ut_stream_tx_t* send_streams_next;  // Where `ut_stream_next` resumes its round robin.
 
-  send_win_t send_win;
-  recv_win_t recv_win;
-  uint32_t cong_win;
-  uint32_t send_adv_win;
-  uint32_t slow_start_thresh;
+  /* Taken by both sides, off the data path. */
+  _Alignas(UT_CACHELINE) pthread_mutex_t recv_lock;
+  pthread_cond_t wait_cond;
+  pthread_mutex_t send_lock;  // Guards the region list and stream send state.
+  pthread_cond_t send_cond;
+
+  atomic_int dying;
+  pthread_mutex_t death_lock;
+  pthread_cond_t death_cond;  // Signaled on handoff and close state changes.
+  int linger;                 // ms `ut_close` waits for a graceful close, or UT_LINGER_BACKGROUND.
+  bool abort;                 // Stop without flushing remaining data or exchanging FINs.
+  bool handoff_req;           // `ut_close` asks the backend to move to its own copy.
+  bool detached;              // This is the backend's copy; the application is gone.
+  void* handoff;              // The backend's copy, once handed off.
+  ut_close_state_t close_state;
 } ut_socket_t;
 
+/**
+ * Fills in the default options for a socket.
+ *
+ * Each option starts from its grading.h value and may be overridden by the
+ * environment variable named next to it in `ut_socket_opts_t`. Invalid
+ * environment values are ignored. Every call picks the next CPU from
+ * UT_TCP_CPUS.
+ *
+ * @param opts The options to fill in.
+ */
+void ut_socket_opts_init(ut_socket_opts_t* opts);
+
+/**
+ * Constructs a UTCS-TCP socket with explicit options.
+ *
+ * `ut_socket` is this function with the options of `ut_socket_opts_init`.
+ *
+ * @param sock The structure with the socket state. It will be initialized by
+ *             this function.
+ * @param socket_type Indicates the type of socket: Listener or Initiator.
+ * @param port Port to either connect to, or bind to. (Based on socket_type.)
+ * @param server_ip IP address of the server to connect to. (Only used if the
+ *                 socket is an initiator.)
+ * @param opts The options, or NULL for the defaults.
+ *
+ * @return 0 on success, -1 on error or if an option is out of range.
+ */
+int ut_socket_ex(ut_socket_t* sock, const ut_socket_type_t socket_type,
+                 const int port, const char* server_ip,
+                 const ut_socket_opts_t* opts);
+
+/**
+ * Sets how `ut_close` waits for the connection to close.
+ *
+ * @param sock The socket.
+ * @param linger_ms `UT_LINGER_BACKGROUND` to close in the background, 0 to
+ *                  discard unsent data and stop at once, or the number of
+ *                  milliseconds to wait for the data to be acknowledged and
+ *                  FINs exchanged before giving up and discarding the rest.
+ */
+void ut_set_linger(ut_socket_t* sock, int linger_ms);
+
+/**
+ * Writes data from several buffers to a UTCS-TCP socket.
+ *
+ * The buffers are appended to the send stream in order, as if they had been
+ * concatenated and passed to `ut_write`, straight into the send ring.
+ *
+ * @param sock The socket to write to.
+ * @param iov The buffers to write.
+ * @param iovcnt The number of entries in `iov`.
+ *
+ * @return 0 on success, -1 on error or if the buffers add up to more than
+ *         INT_MAX bytes, in which case nothing is written.
+ */
+int ut_writev(ut_socket_t* sock, const struct iovec* iov, int iovcnt);
+
+/**
+ * Sends a message on a UTCS-TCP socket.
+ *
+ * The message is delivered whole by a single `ut_recv_msg` on the peer.
+ * Message and stream calls must not be mixed on the same connection.
+ *
+ * @param sock The socket to write to.
+ * @param buf The message.
+ * @param length The message length, from 1 to `opts.recv_buf -
+ *               UT_MSG_HDR_LEN`. The peer needs a `recv_buf` at least as
+ *               large as this socket's to take the largest message.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int ut_send_msg(ut_socket_t* sock, const void* buf, int length);
+
+/**
+ * Queues a region of a file for transmission on a UTCS-TCP socket.
+ *
+ * The file contents are not copied into the send buffer. The backend reads
+ * each segment directly from the file when it is (re)transmitted, so memory
+ * use does not grow with the size of the region. The descriptor is
+ * duplicated, so the caller may close `fd` as soon as this returns, but must
+ * not truncate the file until the data has been acknowledged.
+ *
+ * @param sock The socket to write to.
+ * @param fd A readable descriptor of a regular file.
+ * @param offset File offset of the first byte to send.
+ * @param len The number of bytes to send. The region must lie within the
+ *            file (errno is EINVAL otherwise).
+ *
+ * @return 0 on success, -1 on error, in which case nothing was queued.
+ */
+int ut_sendfile(ut_socket_t* sock, int fd, off_t offset, size_t len);
+
 /*
  * DO NOT CHANGE THE DECLARATIONS BELOW
  */
@@ -113,6 +427,14 @@ int ut_socket(ut_socket_t* sock, const ut_socket_type_t socket_type,
 /**
  * Closes a UTCS-TCP socket.
  *
+ * By default returns at once: the backend moves the connection to state it
+ * owns, flushes the remaining data, exchanges FINs, and hands the port to a
+ * shared reaper for TIME_WAIT. `sock` may be reused or freed as soon as this
+ * returns. Set a linger timeout with `ut_set_linger` to wait for the close
+ * instead. If the backend does not take over within UT_HANDOFF_TIMEOUT,
+ * this waits for it to finish the close. If the backend thread has already
+ * exited, this returns as soon as it notices.
+ *
  * @param sock The socket to close.
  *
  * @return 0 on success, -1 on error.
@@ -148,4 +470,82 @@ int ut_read(ut_socket_t* sock, void* buf, const int length,
  */
 int ut_write(ut_socket_t* sock, const void* buf, int length);
 
+/*
+ * Extensions that take a `ut_read_mode_t`, and so follow the declarations
+ * above.
+ */
+
+/**
+ * Reads data from a UTCS-TCP socket into several buffers.
+ *
+ * Behaves like `ut_read`, but fills `iov[0]`, then `iov[1]`, and so on,
+ * straight from the receive ring in one pass.
+ *
+ * @param sock The socket to read from.
+ * @param iov The buffers to read into.
+ * @param iovcnt The number of entries in `iov`.
+ * @param flags Flags that determine how the socket should wait for data.
+ *
+ * @return The total number of bytes read on success, -1 on error.
+ */
+int ut_readv(ut_socket_t* sock, const struct iovec* iov, int iovcnt,
+             ut_read_mode_t flags);
+
+/**
+ * Receives a message sent with `ut_send_msg`.
+ *
+ * Only ever returns complete messages. With `NO_WAIT`, returns 0 if the next
+ * message has not fully arrived yet.
+ *
+ * @param sock The socket to read from.
+ * @param buf The buffer to receive the message into.
+ * @param length The size of `buf`. If the next message is larger, it is left
+ *               in the socket and -1 is returned.
+ * @param flags Flags that determine how the socket should wait for data.
+ *
+ * @return The message length on success, -1 on error or if the next message
+ *         does not fit the receive buffer. Such a message is skipped, and the
+ *         next call returns the one after it.
+ */
+int ut_recv_msg(ut_socket_t* sock, void* buf, int length, ut_read_mode_t flags);
+
+/*
+ * The functions below may be used by one reading thread and one writing
+ * thread per socket at a time.
+ */
+
+/**
+ * Lends the application the data available in the receive buffer.
+ *
+ * Instead of copying, fills `spans` with pointers into the socket's receive
+ * ring. The data may wrap around the end of the ring, in which case it is
+ * split across both spans; otherwise `spans[1]` is empty. The spans cover
+ * every byte that has not been released yet, so calling this again without
+ * a release returns the same data plus anything that arrived since.
+ *
+ * The spans stay valid until the bytes are released with `ut_recv_release`
+ * or the socket is closed. The receive window only reopens on release. Do
+ * not mix with `ut_read`/`ut_readv` while spans are outstanding, and use it
+ * from one thread at a time: unlike the copying reads, lending is not
+ * serialized between threads.
+ *
+ * @param sock The socket to read from.
+ * @param spans Filled with up to two spans of received data.
+ * @param flags Flags that determine how the socket should wait for data.
+ *
+ * @return The total number of bytes lent on success, -1 on error.
+ */
+int ut_recv_zc(ut_socket_t* sock, struct iovec spans[2], ut_read_mode_t flags);
+
+/**
+ * Returns bytes lent by `ut_recv_zc` to the socket.
+ *
+ * @param sock The socket the bytes were lent from.
+ * @param length The number of bytes, from the start of the lent data, that
+ *               the application is done with.
+ *
+ * @return 0 on success, -1 if more bytes are released than are available.
+ */
+int ut_recv_release(ut_socket_t* sock, uint32_t length);
+
 #endif  // UTCS356_ASSN4_INC_UTCS_TCP_H_
@@ -0,0 +1,23 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_INC_UT_TIME_H_
+#define UTCS356_ASSN4_INC_UT_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Reads the clock that the library's timers and deadlines are kept in.
+ *
+ * @return CLOCK_MONOTONIC time in ms.
+ */
+static inline int64_t ut_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif  // UTCS356_ASSN4_INC_UT_TIME_H_
@@ -3,19 +3,23 @@
  * Copyright (C) 2025 University of Texas at Austin
  */
 
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "ut_tcp.h"
 
 #define BUF_SIZE 16000
+#define CLOSE_LINGER 30000  // ms
 
 void functionality(ut_socket_t *sock) {
   uint8_t buf[BUF_SIZE];
   int read;
-  FILE *fp;
+  int fd;
+  struct stat st;
 
   ut_write(sock, "Knock knock", 11);
   read = ut_read(sock, buf, 200, NO_FLAG);
@@ -31,36 +35,27 @@ void functionality(ut_socket_t *sock) {
 
   sleep(1);
 
-  fp = fopen("tests/random.input", "rb"); 
-  if (fp == NULL) {
+  fd = open("tests/random.input", O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
     perror("Error opening file");
     exit(EXIT_FAILURE);
   }
-  read = 1;
-  int total_read = 0;
-  while (read > 0) {
-    read = fread(buf, 1, 2000, fp);
-    if (read > 0) {
-      int error = 0;
-      int retry = 0;
-      do {
-        error = ut_write(sock, buf, read);
-        if (error != 0){
-          retry++;
-          printf("Error writing to socket, retrying...: %d\n", retry);
-          sleep(1);
-        }
-      } while(error != 0 && retry < 10);
-      if (error != 0) {
-        perror("Error writing to socket");
-        exit(EXIT_FAILURE);
-      }
+  int error = 0;
+  int retry = 0;
+  do {
+    error = ut_sendfile(sock, fd, 0, st.st_size);
+    if (error != 0) {
+      retry++;
+      printf("Error writing to socket, retrying...: %d\n", retry);
+      sleep(1);
     }
-    total_read += read;
+  } while (error != 0 && retry < 10);
+  if (error != 0) {
+    perror("Error writing to socket");
+    exit(EXIT_FAILURE);
   }
-  printf("Total read: %d\n", total_read);
-  sleep(1);
-  fclose(fp);
+  printf("Total read: %lld\n", (long long)st.st_size);
+  close(fd);
 }
 
 int main() {
@@ -86,6 +81,9 @@ int main() {
 
   functionality(&socket);
 
+  // The process exits right after closing, so wait for the data to be
+  // delivered instead of closing in the background.
+  ut_set_linger(&socket, CLOSE_LINGER);
   if (ut_close(&socket) < 0) {
     exit(EXIT_FAILURE);
   }
@@ -0,0 +1,304 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#include "ut_cache.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_SLOTS 256  // Power of two.
+
+#define CACHE_MAGIC 0x55544348  // "UTCH"
+#define CACHE_VERSION 1
+
+// Starts the cache file. A file from another program, another version, or
+// a build with a different entry layout is ignored and then replaced.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t count;  // Entries that follow.
+} cache_file_header_t;
+
+static ut_cache_entry_t cache[CACHE_SLOTS];
+static bool cache_used[CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t cookie_key[2];
+static pthread_once_t cookie_once = PTHREAD_ONCE_INIT;
+
+// With UT_TCP_CACHE_FILE set, the cache is also kept in that file, so a
+// short-lived client starts where earlier processes left off. Processes
+// sharing the file merge their entries into it; the newest entry for a
+// destination wins.
+static const char *cache_file;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static int64_t now(void) {
+  struct timespec ts;
+  // Wall-clock time, since entries may come from an earlier process.
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec;
+}
+
+/*
+ * Direct-mapped: a destination lives in one slot, and a newer destination
+ * that hashes to the same slot evicts it.
+ */
+static uint32_t slot_of(const struct sockaddr_in *addr) {
+  uint32_t h = addr->sin_addr.s_addr * 2654435761u;
+  h ^= addr->sin_port * 40503u;
+  return (h >> 16) & (CACHE_SLOTS - 1);
+}
+
+static bool same_dest(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*
+ * Merges the cache file, if any, into the cache: an entry replaces the one
+ * in its slot unless that one was updated more recently. Must be called
+ * with `cache_lock` held, or before the cache is shared.
+ */
+static void cache_merge(void) {
+  cache_file_header_t header;
+  ut_cache_entry_t entry;
+  FILE *f = fopen(cache_file, "rb");
+
+  if (f == NULL) {
+    return;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+      header.entry_size != sizeof(entry) || header.count > CACHE_SLOTS) {
+    fclose(f);
+    return;
+  }
+  for (uint32_t i = 0; i < header.count; i++) {
+    uint32_t slot;
+
+    if (fread(&entry, sizeof(entry), 1, f) != 1) {
+      break;
+    }
+    if (entry.addr.sin_family != AF_INET) {
+      continue;
+    }
+    slot = slot_of(&entry.addr);
+    if (!cache_used[slot] || entry.updated > cache[slot].updated) {
+      cache[slot] = entry;
+      cache_used[slot] = true;
+    }
+  }
+  fclose(f);
+}
+
+/*
+ * Reads the cache file, if any. Runs once, before the first cache access.
+ */
+static void cache_load(void) {
+  cache_file = getenv("UT_TCP_CACHE_FILE");
+  if (cache_file != NULL) {
+    cache_merge();
+  }
+}
+
+/*
+ * Rewrites the cache file, if any. Other processes may have written it
+ * since it was read, so under an exclusive lock on a companion lock file
+ * their entries are merged in first. The new contents go to a private file
+ * that then replaces the old one, so readers never see a partial file.
+ * Must be called with `cache_lock` held.
+ */
+static void cache_save(void) {
+  char path[PATH_MAX];
+  cache_file_header_t header = {.magic = CACHE_MAGIC,
+                                .version = CACHE_VERSION,
+                                .entry_size = sizeof(ut_cache_entry_t)};
+  FILE *f;
+  int lock_fd;
+
+  if (cache_file == NULL) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s.lock", cache_file);
+  lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+    if (lock_fd >= 0) {
+      close(lock_fd);
+    }
+    return;
+  }
+  cache_merge();
+
+  snprintf(path, sizeof(path), "%s.%d", cache_file, (int)getpid());
+  f = fopen(path, "wb");
+  if (f != NULL) {
+    for (uint32_t slot = 0; slot < CACHE_SLOTS; slot++) {
+      header.count += cache_used[slot];
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    for (uint32_t slot = 0; slot < CACHE_SLOTS; slot++) {
+      if (cache_used[slot]) {
+        fwrite(&cache[slot], sizeof(cache[slot]), 1, f);
+      }
+    }
+    if (fclose(f) != 0 || rename(path, cache_file) != 0) {
+      unlink(path);
+    }
+  }
+  close(lock_fd);
+}
+
+/*
+ * Returns the slot of `addr`, claiming (and resetting) it if it holds
+ * another destination. Must be called with `cache_lock` held.
+ */
+static ut_cache_entry_t *claim(const struct sockaddr_in *addr) {
+  uint32_t slot = slot_of(addr);
+  ut_cache_entry_t *entry = &cache[slot];
+
+  if (!cache_used[slot] || !same_dest(&entry->addr, addr)) {
+    memset(entry, 0, sizeof(*entry));
+    entry->addr = *addr;
+    cache_used[slot] = true;
+  }
+  entry->updated = now();
+  return entry;
+}
+
+int ut_cache_lookup(const struct sockaddr_in *addr, ut_cache_entry_t *entry) {
+  uint32_t slot = slot_of(addr);
+  int found;
+
+  pthread_once(&cache_once, cache_load);
+  pthread_mutex_lock(&cache_lock);
+  found = cache_used[slot] && same_dest(&cache[slot].addr, addr) &&
+          now() - cache[slot].updated < CACHE_EXPIRY;
+  if (found) {
+    *entry = cache[slot];
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return found;
+}
+
+void ut_cache_update(const struct sockaddr_in *addr, uint32_t srtt,
+                     uint32_t cong_win, uint32_t slow_start_thresh) {
+  ut_cache_entry_t *entry;
+
+  pthread_once(&cache_once, cache_load);
+  pthread_mutex_lock(&cache_lock);
+  entry = claim(addr);
+  if (srtt != 0) {
+    entry->srtt = srtt;
+  }
+  entry->cong_win = cong_win;
+  entry->slow_start_thresh = slow_start_thresh;
+  entry->have_metrics = true;
+  cache_save();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void ut_cache_set_cookie(const struct sockaddr_in *addr, uint64_t cookie) {
+  ut_cache_entry_t *entry;
+
+  pthread_once(&cache_once, cache_load);
+  pthread_mutex_lock(&cache_lock);
+  entry = claim(addr);
+  entry->cookie = cookie;
+  entry->have_cookie = true;
+  cache_save();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void ut_cache_clear_cookie(const struct sockaddr_in *addr) {
+  uint32_t slot = slot_of(addr);
+
+  pthread_once(&cache_once, cache_load);
+  pthread_mutex_lock(&cache_lock);
+  if (cache_used[slot] && same_dest(&cache[slot].addr, addr)) {
+    cache[slot].have_cookie = false;
+    // Newer than the copy in the file, so merging does not bring it back.
+    cache[slot].updated = now();
+  }
+  cache_save();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void cookie_init(void) {
+  int fd = open("/dev/urandom", O_RDONLY);
+
+  if (fd < 0 || read(fd, cookie_key, sizeof(cookie_key)) !=
+                    (ssize_t)sizeof(cookie_key)) {
+    // Fall back to something that still differs between processes.
+    cookie_key[0] = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    cookie_key[1] = (uint64_t)(uintptr_t)&cookie_key ^ cookie_key[0] * 31;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND        \
+  do {                  \
+    v0 += v1;           \
+    v1 = ROTL(v1, 13);  \
+    v1 ^= v0;           \
+    v0 = ROTL(v0, 32);  \
+    v2 += v3;           \
+    v3 = ROTL(v3, 16);  \
+    v3 ^= v2;           \
+    v0 += v3;           \
+    v3 = ROTL(v3, 21);  \
+    v3 ^= v0;           \
+    v2 += v1;           \
+    v1 = ROTL(v1, 17);  \
+    v1 ^= v2;           \
+    v2 = ROTL(v2, 32);  \
+  } while (0)
+
+/*
+ * SipHash-2-4 of a single 8-byte message.
+ */
+static uint64_t siphash64(uint64_t m) {
+  uint64_t v0 = cookie_key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = cookie_key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = cookie_key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = cookie_key[1] ^ 0x7465646279746573ULL;
+  uint64_t b = 8ULL << 56;
+
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t ut_cookie_generate(const struct sockaddr_in *addr) {
+  pthread_once(&cookie_once, cookie_init);
+  // Bound to the client IP only, like TCP Fast Open, so a client keeps its
+  // cookie across source ports.
+  return siphash64(addr->sin_addr.s_addr);
+}
+
+int ut_cookie_check(const struct sockaddr_in *addr, uint64_t cookie) {
+  return cookie != 0 && ut_cookie_generate(addr) == cookie;
+}
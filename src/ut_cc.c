@@ -0,0 +1,129 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#include "ut_cc.h"
+
+#include "backend.h"
+#include "ut_time.h"
+
+// CUBIC constants from RFC 8312.
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/*
+ * Cube root by Newton's method, so the library does not need libm.
+ */
+static double cube_root(double x) {
+  double r = x > 1 ? x / 3 : 1;
+
+  if (x <= 0) {
+    return 0;
+  }
+  for (int i = 0; i < 64; i++) {
+    double next = r - (r * r * r - x) / (3 * r * r);
+    if (next == r) {
+      break;
+    }
+    r = next;
+  }
+  return r;
+}
+
+/*
+ * Window of the CUBIC curve `t` ms into the current epoch, raised to the
+ * window Reno would have reached if that is larger.
+ */
+static double cubic_target(ut_socket_t* sock, int64_t t) {
+  double mss = ut_mss(sock);
+  double dt = (t - (int64_t)sock->cc_k) / 1000.0;
+  double w_cubic = CUBIC_C * dt * dt * dt * mss + sock->cc_w_max;
+  uint32_t rtt = sock->srtt ? sock->srtt : sock->opts.rto_min;
+  double w_est = sock->cc_w_max * CUBIC_BETA +
+                 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * t / rtt * mss;
+
+  return w_cubic > w_est ? w_cubic : w_est;
+}
+
+static void cubic_on_ack(ut_socket_t* sock, uint32_t acked) {
+  uint32_t mss = ut_mss(sock);
+  int64_t now = ut_now_ms();
+  double target, grow;
+
+  if (sock->cc_epoch == 0) {
+    sock->cc_epoch = now;
+    if (sock->cong_win < sock->cc_w_max) {
+      sock->cc_k = cube_root((double)(sock->cc_w_max - sock->cong_win) / mss /
+                             CUBIC_C) *
+                   1000;
+    } else {
+      sock->cc_k = 0;
+      sock->cc_w_max = sock->cong_win;
+    }
+  }
+
+  target = cubic_target(sock, now - sock->cc_epoch);
+  if (target > 1.5 * sock->cong_win) {
+    target = 1.5 * sock->cong_win;
+  }
+  if (target > sock->cong_win) {
+    grow = (target - sock->cong_win) * acked / sock->cong_win;
+  } else {
+    // Probe very slowly around the plateau.
+    grow = (double)mss * acked / (100.0 * sock->cong_win);
+  }
+  sock->cong_win += grow >= 1 ? (uint32_t)grow : 1;
+}
+
+static void reno_on_ack(ut_socket_t* sock, uint32_t acked) {
+  uint32_t mss = ut_mss(sock);
+  uint32_t grow = (uint64_t)mss * acked / sock->cong_win;
+
+  sock->cong_win += grow > 0 ? grow : 1;
+}
+
+void ut_cc_on_ack(ut_socket_t* sock, uint32_t acked) {
+  uint32_t mss = ut_mss(sock);
+
+  if (acked == 0) {
+    return;
+  }
+  if (sock->cong_win < sock->slow_start_thresh) {
+    // Count at most one MSS per ACK so stretch ACKs cannot burst.
+    sock->cong_win += acked < mss ? acked : mss;
+    return;
+  }
+  switch (sock->opts.cc) {
+    case UT_CC_CUBIC:
+      cubic_on_ack(sock, acked);
+      break;
+    case UT_CC_RENO:
+    default:
+      reno_on_ack(sock, acked);
+  }
+}
+
+void ut_cc_on_loss(ut_socket_t* sock, bool timeout) {
+  uint32_t mss = ut_mss(sock);
+  uint32_t thresh;
+
+  switch (sock->opts.cc) {
+    case UT_CC_CUBIC:
+      // Fast convergence: a flow that lost before reaching its previous
+      // peak releases bandwidth to newer flows.
+      if (sock->cong_win < sock->cc_w_max) {
+        sock->cc_w_max = sock->cong_win * (1 + CUBIC_BETA) / 2;
+      } else {
+        sock->cc_w_max = sock->cong_win;
+      }
+      sock->cc_epoch = 0;
+      thresh = sock->cong_win * CUBIC_BETA;
+      break;
+    case UT_CC_RENO:
+    default:
+      thresh = sock->cong_win / 2;
+  }
+  sock->slow_start_thresh = thresh > 2 * mss ? thresh : 2 * mss;
+  sock->cong_win = timeout ? mss : sock->slow_start_thresh;
+}
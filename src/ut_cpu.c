@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#define _GNU_SOURCE
+
+#include "ut_cpu.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Highest NUMA node `ut_cpu_alloc` can place memory on, plus one.
+#define MAX_NODES 1024
+
+static int cpus[CPU_SETSIZE];
+static int cpu_count = 0;
+static atomic_uint cpu_next = 0;
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Parses `UT_TCP_CPUS` once. CPUs the process may not run on are skipped, so
+ * a list written for a bigger machine still pins to the CPUs that exist.
+ */
+static void parse_cpus(void) {
+  const char* list = getenv("UT_TCP_CPUS");
+  cpu_set_t allowed;
+  char* end;
+  long first, last;
+
+  if (list == NULL || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+  while (*list != '\0') {
+    first = strtol(list, &end, 10);
+    if (end == list) {
+      break;
+    }
+    last = first;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list) {
+        break;
+      }
+    }
+    for (long cpu = first; cpu <= last && cpu_count < CPU_SETSIZE; cpu++) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+        cpus[cpu_count++] = (int)cpu;
+      }
+    }
+    if (*end != ',') {
+      break;
+    }
+    list = end + 1;
+  }
+}
+
+int ut_cpu_pick(void) {
+  pthread_once(&cpu_once, parse_cpus);
+  if (cpu_count == 0) {
+    return -1;
+  }
+  return cpus[atomic_fetch_add(&cpu_next, 1) % cpu_count];
+}
+
+int ut_cpu_bind_attr(pthread_attr_t* attr, int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0) {
+    return 0;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_attr_setaffinity_np(attr, sizeof(set), &set) != 0) {
+    perror("ERROR setting backend affinity");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns the NUMA node of a CPU, from the `nodeN` link sysfs keeps in the
+ * CPU's directory, or -1 if the kernel does not report one.
+ */
+static int cpu_node(int cpu) {
+  char path[64];
+  struct dirent* entry;
+  DIR* dir;
+  int node = -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    char* end;
+    long n;
+
+    if (strncmp(entry->d_name, "node", 4) != 0) {
+      continue;
+    }
+    n = strtol(entry->d_name + 4, &end, 10);
+    if (end != entry->d_name + 4 && *end == '\0' && n >= 0 && n < MAX_NODES) {
+      node = (int)n;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+void* ut_cpu_alloc(size_t size, int cpu) {
+  unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+  void* mem;
+  int node;
+
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  if (cpu < 0) {
+    return mem;
+  }
+
+  node = cpu_node(cpu);
+  if (node >= 0) {
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    // Preferred rather than bound, so a full node spills over instead of
+    // failing the allocation. Without NUMA support this fails harmlessly.
+    syscall(SYS_mbind, mem, size, MPOL_PREFERRED, mask, MAX_NODES, 0);
+  }
+  // Commit the pages now, under the policy above, so the data path never
+  // takes a page fault on them.
+  memset(mem, 0, size);
+  return mem;
+}
+
+void ut_cpu_free(void* ptr, size_t size) {
+  if (ptr != NULL) {
+    munmap(ptr, size);
+  }
+}
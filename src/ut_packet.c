@@ -6,10 +6,16 @@
 #include "ut_packet.h"
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define UT_HAVE_SSSE3 1
+#endif
+
 uint16_t get_src(ut_tcp_header_t* header) {
   return ntohs(header->source_port);
 }
@@ -80,7 +86,7 @@ void set_header(ut_tcp_header_t* header, uint16_t src, uint16_t dst,
 
 uint8_t* get_payload(uint8_t* pkt) {
   ut_tcp_header_t* header = (ut_tcp_header_t*)pkt;
-  int offset = sizeof(ut_tcp_header_t);
+  int offset = get_hlen(header);
   return (uint8_t*)header + offset;
 }
 
@@ -91,7 +97,7 @@ uint16_t get_payload_len(uint8_t* pkt) {
 
 void set_payload(uint8_t* pkt, uint8_t* payload, uint16_t payload_len) {
   ut_tcp_header_t* header = (ut_tcp_header_t*)pkt;
-  int offset = sizeof(ut_tcp_header_t);
+  int offset = get_hlen(header);
   memcpy((uint8_t*)header + offset, payload, payload_len);
 }
 
@@ -105,16 +111,247 @@ uint8_t* create_packet(uint16_t src, uint16_t dst, uint32_t seq, uint32_t ack,
     return NULL;
   }
 
-  uint8_t* packet = malloc(sizeof(ut_tcp_header_t) + payload_len);
+  uint8_t* packet = malloc(hlen + payload_len);
   if (packet == NULL) {
     return NULL;
   }
 
   ut_tcp_header_t* header = (ut_tcp_header_t*)packet;
   set_header(header, src, dst, seq, ack, hlen, plen, flags, adv_window);
+  // Header extensions start zeroed; their owners fill them in.
+  memset(packet + sizeof(ut_tcp_header_t), 0, hlen - sizeof(ut_tcp_header_t));
 
   uint8_t* pkt_payload = get_payload(packet);
   memcpy(pkt_payload, payload, payload_len);
 
   return packet;
 }
+
+void set_stream(uint8_t* pkt, uint16_t stream_id, uint32_t stream_off) {
+  uint8_t* ext = pkt + stream_ext_offset(get_flags((ut_tcp_header_t*)pkt));
+  stream_id = htons(stream_id);
+  stream_off = htonl(stream_off);
+  memcpy(ext, &stream_id, 2);
+  memcpy(ext + 2, &stream_off, 4);
+}
+
+void get_stream(uint8_t* pkt, uint16_t* stream_id, uint32_t* stream_off) {
+  uint8_t* ext = pkt + stream_ext_offset(get_flags((ut_tcp_header_t*)pkt));
+  memcpy(stream_id, ext, 2);
+  memcpy(stream_off, ext + 2, 4);
+  *stream_id = ntohs(*stream_id);
+  *stream_off = ntohl(*stream_off);
+}
+
+void set_cookie(uint8_t* pkt, uint64_t cookie) {
+  uint8_t* ext = pkt + cookie_ext_offset(get_flags((ut_tcp_header_t*)pkt));
+  uint32_t halves[2] = {htonl(cookie >> 32), htonl((uint32_t)cookie)};
+  memcpy(ext, halves, COOKIE_EXT_LEN);
+}
+
+uint64_t get_cookie(uint8_t* pkt) {
+  uint8_t* ext = pkt + cookie_ext_offset(get_flags((ut_tcp_header_t*)pkt));
+  uint32_t halves[2];
+  memcpy(halves, ext, COOKIE_EXT_LEN);
+  return ((uint64_t)ntohl(halves[0]) << 32) | ntohl(halves[1]);
+}
+
+static bool decode_use_ssse3;
+
+#ifdef UT_HAVE_SSSE3
+/*
+ * `decode_header` with the identifier, ports, seq and ack reversed by a
+ * single shuffle. Built for SSSE3 regardless of the compiler flags and only
+ * called when the CPU has it.
+ */
+__attribute__((target("ssse3"))) static void decode_header_ssse3(
+    const uint8_t* pkt, ut_tcp_header_host_t* out) {
+  const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 5, 4, 7, 6, 11, 10, 9, 8, 15,
+                                     14, 13, 12);
+  __m128i v = _mm_loadu_si128((const __m128i*)pkt);
+  _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(v, swap));
+  decode_header_tail(pkt, out);
+}
+#endif
+
+__attribute__((constructor)) static void decode_init(void) {
+#ifdef UT_HAVE_SSSE3
+  __builtin_cpu_init();
+  decode_use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+int validate_packets(uint8_t* const* pkts, const uint32_t* lens, int n,
+                     uint16_t port, bool require_csum,
+                     ut_tcp_header_host_t* hdrs, uint8_t* valid,
+                     uint64_t* csum_drops) {
+  int count = 0;
+
+  for (int i = 0; i < n; i++) {
+    ut_tcp_header_host_t* hdr = &hdrs[i];
+    int ok;
+
+    if (lens[i] < sizeof(ut_tcp_header_t)) {
+      valid[i] = 0;
+      continue;
+    }
+#ifdef UT_HAVE_SSSE3
+    if (decode_use_ssse3) {
+      decode_header_ssse3(pkts[i], hdr);
+    } else {
+      decode_header(pkts[i], hdr);
+    }
+#else
+    decode_header(pkts[i], hdr);
+#endif
+    // The header checks are combined with `&` rather than `&&`, and an
+    // extension that is absent passes its length check, so mixed batches
+    // do not mispredict on each datagram. Only the checksum, which reads
+    // the whole payload, is behind a branch. Once checksums are negotiated
+    // a datagram without one is dropped: otherwise clearing the flag would
+    // skip the CRC and have the CRC bytes read as the next extension.
+    ok = (hdr->identifier == IDENTIFIER) &
+         (hdr->hlen >= sizeof(ut_tcp_header_t)) & (hdr->hlen <= hdr->plen) &
+         (hdr->plen == lens[i]) & (hdr->destination_port == port);
+    ok &= !(hdr->flags & STREAM_FLAG_MASK) |
+          (hdr->hlen >= stream_ext_offset(hdr->flags) + STREAM_EXT_LEN);
+    ok &= !(hdr->flags & COOKIE_FLAG_MASK) |
+          (hdr->hlen >= cookie_ext_offset(hdr->flags) + COOKIE_EXT_LEN);
+    if (ok && (require_csum || (hdr->flags & CSUM_FLAG_MASK))) {
+      ok = (hdr->flags & CSUM_FLAG_MASK) && verify_checksum(pkts[i]);
+      if (!ok && csum_drops != NULL) {
+        (*csum_drops)++;
+      }
+    }
+    valid[i] = ok;
+    count += ok;
+  }
+  return count;
+}
+
+#define CRC32C_POLY 0x82F63B78  // Reflected Castagnoli polynomial.
+
+// Bytes each of the three interleaved `crc32` chains covers per round.
+#define CRC32C_BLOCK 128
+
+static uint32_t crc32c_table[256];
+// crc32c_shift[k][b] is byte k of a CRC, with value b, advanced over
+// CRC32C_BLOCK zero bytes.
+static uint32_t crc32c_shift[4][256];
+static bool crc32c_use_sse42;
+
+__attribute__((constructor)) static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    }
+    crc32c_table[i] = crc;
+  }
+  for (int k = 0; k < 4; k++) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i << (8 * k);
+      for (int n = 0; n < CRC32C_BLOCK; n++) {
+        crc = (crc >> 8) ^ crc32c_table[crc & 0xFF];
+      }
+      crc32c_shift[k][i] = crc;
+    }
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  crc32c_use_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/*
+ * Advances a CRC over CRC32C_BLOCK zero bytes, so that the CRC of a block
+ * can be combined with the CRC of the block after it.
+ */
+static inline uint32_t crc32c_skip_block(uint32_t crc) {
+  return crc32c_shift[0][crc & 0xFF] ^ crc32c_shift[1][(crc >> 8) & 0xFF] ^
+         crc32c_shift[2][(crc >> 16) & 0xFF] ^ crc32c_shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/*
+ * `crc32` has a latency of three cycles but issues every cycle, so one
+ * chain leaves two thirds of the unit idle. Each round runs three chains
+ * over adjacent blocks and then combines them.
+ */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint32_t crc, const uint8_t* buf, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 3 * CRC32C_BLOCK) {
+    uint64_t crc1 = 0, crc2 = 0;
+    for (int i = 0; i < CRC32C_BLOCK; i += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, buf + i, 8);
+      memcpy(&w1, buf + CRC32C_BLOCK + i, 8);
+      memcpy(&w2, buf + 2 * CRC32C_BLOCK + i, 8);
+      crc64 = __builtin_ia32_crc32di(crc64, w0);
+      crc1 = __builtin_ia32_crc32di(crc1, w1);
+      crc2 = __builtin_ia32_crc32di(crc2, w2);
+    }
+    crc64 = crc32c_skip_block((uint32_t)crc64) ^ (uint32_t)crc1;
+    crc64 = crc32c_skip_block((uint32_t)crc64) ^ (uint32_t)crc2;
+    buf += 3 * CRC32C_BLOCK;
+    len -= 3 * CRC32C_BLOCK;
+  }
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, buf, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+    buf += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len > 0) {
+    crc = __builtin_ia32_crc32qi(crc, *buf++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t* buf, size_t len) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_use_sse42) {
+    return ~crc32c_sse42(crc, buf, len);
+  }
+#endif
+  while (len > 0) {
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ *buf++) & 0xFF];
+    len--;
+  }
+  return ~crc;
+}
+
+/*
+ * CRC of everything in the packet except the checksum extension itself.
+ */
+static uint32_t packet_crc(uint8_t* pkt) {
+  ut_tcp_header_t* header = (ut_tcp_header_t*)pkt;
+  size_t skip = sizeof(ut_tcp_header_t) + CSUM_EXT_LEN;
+  uint32_t crc = crc32c(0, pkt, sizeof(ut_tcp_header_t));
+  return crc32c(crc, pkt + skip, get_plen(header) - skip);
+}
+
+void set_checksum(uint8_t* pkt) {
+  uint32_t crc = htonl(packet_crc(pkt));
+  memcpy(pkt + sizeof(ut_tcp_header_t), &crc, CSUM_EXT_LEN);
+}
+
+int verify_checksum(uint8_t* pkt) {
+  ut_tcp_header_t* header = (ut_tcp_header_t*)pkt;
+  uint32_t crc;
+
+  if (!(get_flags(header) & CSUM_FLAG_MASK)) {
+    return 1;
+  }
+  if (get_hlen(header) < sizeof(ut_tcp_header_t) + CSUM_EXT_LEN) {
+    return 0;
+  }
+  memcpy(&crc, pkt + sizeof(ut_tcp_header_t), CSUM_EXT_LEN);
+  return ntohl(crc) == packet_crc(pkt);
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#include "ut_pmtu.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "backend.h"
+#include "ut_time.h"
+
+/*
+ * Restarts the search between the MTU the connection uses now and
+ * `opts.max_mtu`.
+ */
+static void restart_search(ut_socket_t* sock) {
+  sock->pmtu_lo = atomic_load_explicit(&sock->max_len, memory_order_relaxed) +
+                  UT_IP_UDP_OVERHEAD;
+  sock->pmtu_hi = sock->opts.max_mtu + 1;
+  sock->pmtu_probe = 0;
+  sock->pmtu_probe_count = 0;
+}
+
+static int search_done(ut_socket_t* sock) {
+  return sock->pmtu_hi - sock->pmtu_lo <= PMTU_GRANULARITY;
+}
+
+/*
+ * Records that `mtu` is too big for the path and schedules a re-probe once
+ * the search has converged.
+ */
+static void probe_failed(ut_socket_t* sock, uint32_t mtu) {
+  sock->pmtu_hi = mtu;
+  sock->pmtu_probe = 0;
+  sock->pmtu_probe_count = 0;
+  if (search_done(sock)) {
+    sock->pmtu_next = ut_now_ms() + PMTU_RAISE_TIMER;
+  }
+}
+
+/*
+ * Sends a probe padded to `mtu`. Only the header and extensions are
+ * meaningful; the receiver discards the rest.
+ *
+ * Only probes carry DF: the socket is switched to IP_PMTUDISC_PROBE for the
+ * one `sendto` and then back, so data packets keep the kernel's default and
+ * are fragmented rather than lost if the path shrinks below `max_len`.
+ */
+static void send_probe(ut_socket_t* sock, uint32_t mtu) {
+  uint16_t hlen = ut_hlen(sock);
+  uint16_t plen = mtu - UT_IP_UDP_OVERHEAD;
+  uint8_t flags = PROBE_FLAG_MASK | (sock->csum_enabled ? CSUM_FLAG_MASK : 0);
+  int mode, probe = IP_PMTUDISC_PROBE;
+  socklen_t mode_len = sizeof(mode);
+  uint8_t* pkt;
+  ssize_t n;
+  int err;
+
+  pkt = calloc(1, plen);
+  if (pkt == NULL) {
+    return;
+  }
+  set_header((ut_tcp_header_t*)pkt, sock->my_port, ntohs(sock->conn.sin_port),
+             sock->pmtu_probe_id, 0, hlen, plen, flags,
+             ut_recv_window(sock));
+  if (sock->csum_enabled) {
+    set_checksum(pkt);
+  }
+  if (getsockopt(sock->socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode,
+                 &mode_len) < 0 ||
+      setsockopt(sock->socket, IPPROTO_IP, IP_MTU_DISCOVER, &probe,
+                 sizeof(probe)) < 0) {
+    perror("ERROR setting IP_MTU_DISCOVER");
+    free(pkt);
+    return;
+  }
+  n = sendto(sock->socket, pkt, plen, 0, (struct sockaddr*)&sock->conn,
+             sizeof(sock->conn));
+  err = errno;
+  setsockopt(sock->socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+  free(pkt);
+
+  if (n < 0 && err == EMSGSIZE) {
+    // Bigger than the local interface or a path MTU the kernel learned.
+    probe_failed(sock, mtu);
+    return;
+  }
+  sock->pmtu_probe = mtu;
+  sock->pmtu_probe_count++;
+  sock->pmtu_probe_sent = ut_now_ms();
+}
+
+void ut_pmtu_init(ut_socket_t* sock) {
+  sock->pmtu_probe_id = 0;
+  sock->pmtu_probe_sent = 0;
+  sock->pmtu_next = 0;
+  restart_search(sock);
+}
+
+void ut_pmtu_tick(ut_socket_t* sock) {
+  int64_t now = ut_now_ms();
+  uint32_t rto, mtu;
+
+  if (sock->pmtu_probe != 0) {
+    rto = ut_rto_clamp(sock, sock->srtt ? 2 * sock->srtt : DEFAULT_TIMEOUT);
+    if (now - sock->pmtu_probe_sent < rto) {
+      return;
+    }
+    if (sock->pmtu_probe_count >= PMTU_MAX_PROBES) {
+      probe_failed(sock, sock->pmtu_probe);
+      return;
+    }
+    // Probes are not retransmitted; a new one with a fresh ID goes out, so
+    // a late ACK for the old one is still valid.
+    mtu = sock->pmtu_probe;
+  } else if (!search_done(sock)) {
+    mtu = sock->pmtu_hi > sock->opts.max_mtu
+              ? sock->opts.max_mtu
+              : sock->pmtu_lo + (sock->pmtu_hi - sock->pmtu_lo) / 2;
+  } else if (sock->pmtu_next != 0 && now >= sock->pmtu_next) {
+    sock->pmtu_next = 0;
+    restart_search(sock);
+    return;
+  } else {
+    return;
+  }
+  sock->pmtu_probe_id++;
+  send_probe(sock, mtu);
+}
+
+int ut_pmtu_on_packet(ut_socket_t* sock, uint8_t* pkt) {
+  ut_tcp_header_host_t hdr;
+  uint16_t hlen;
+  uint8_t* reply;
+
+  decode_header(pkt, &hdr);
+  if (!(hdr.flags & PROBE_FLAG_MASK)) {
+    return 0;
+  }
+
+  if (hdr.flags & ACK_FLAG_MASK) {
+    // Any probe of the current size proves it; IDs only rule out ACKs for
+    // probes sent before this size was chosen.
+    if (sock->pmtu_probe != 0 && !after(hdr.ack_num, sock->pmtu_probe_id) &&
+        !before(hdr.ack_num,
+                sock->pmtu_probe_id - sock->pmtu_probe_count + 1)) {
+      sock->pmtu_lo = sock->pmtu_probe;
+      atomic_store_explicit(&sock->max_len,
+                            sock->pmtu_probe - UT_IP_UDP_OVERHEAD,
+                            memory_order_relaxed);
+      sock->pmtu_probe = 0;
+      sock->pmtu_probe_count = 0;
+      if (search_done(sock)) {
+        sock->pmtu_next = ut_now_ms() + PMTU_RAISE_TIMER;
+      }
+    }
+    return 1;
+  }
+
+  hlen = ut_hlen(sock);
+  reply = create_packet(sock->my_port, ntohs(sock->conn.sin_port), 0,
+                        hdr.seq_num, hlen, hlen,
+                        PROBE_FLAG_MASK | ACK_FLAG_MASK |
+                            (sock->csum_enabled ? CSUM_FLAG_MASK : 0),
+                        ut_recv_window(sock), NULL, 0);
+  if (reply != NULL) {
+    if (sock->csum_enabled) {
+      set_checksum(reply);
+    }
+    sendto(sock->socket, reply, hlen, 0, (struct sockaddr*)&sock->conn,
+           sizeof(sock->conn));
+    free(reply);
+  }
+  return 1;
+}
+
+void ut_pmtu_fall_back(ut_socket_t* sock) {
+  uint32_t base = sock->opts.mtu - UT_IP_UDP_OVERHEAD;
+
+  if (atomic_load_explicit(&sock->max_len, memory_order_relaxed) > base) {
+    atomic_store_explicit(&sock->max_len, base, memory_order_relaxed);
+  }
+  restart_search(sock);
+  // Do not walk straight back into the black hole.
+  sock->pmtu_hi = sock->pmtu_lo;
+  sock->pmtu_next = ut_now_ms() + PMTU_RAISE_TIMER;
+}
@@ -0,0 +1,176 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#include "ut_reaper.h"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "ut_time.h"
+
+// Upper bound on how long a newly added connection waits to be polled.
+#define REAPER_TICK 50  // ms
+
+typedef struct ut_reaped {
+  int fd;
+  struct sockaddr_in peer;
+  uint16_t my_port;
+  uint32_t seq;
+  uint32_t ack;
+  ut_socket_t* owned;
+  int64_t deadline;  // CLOCK_MONOTONIC ms.
+  struct ut_reaped* next;
+} ut_reaped_t;
+
+static ut_reaped_t* reaped = NULL;
+static int reaped_count = 0;
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Re-sends the final ACK if what arrived is a retransmitted FIN from the
+ * peer. Datagrams from anyone else are dropped, so the reaper cannot be
+ * used to reflect ACKs at third parties.
+ */
+static void answer(ut_reaped_t* entry) {
+  uint8_t buf[UT_MAX_PACKET];
+  ut_tcp_header_host_t hdr;
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n;
+
+  while ((n = recvfrom(entry->fd, buf, sizeof(buf), MSG_DONTWAIT,
+                       (struct sockaddr*)&from, &from_len)) >= 0) {
+    bool from_peer = from_len == sizeof(from) &&
+                     from.sin_family == AF_INET &&
+                     from.sin_addr.s_addr == entry->peer.sin_addr.s_addr &&
+                     from.sin_port == entry->peer.sin_port;
+
+    from_len = sizeof(from);
+    if (!from_peer || (size_t)n < sizeof(ut_tcp_header_t)) {
+      continue;
+    }
+    decode_header(buf, &hdr);
+    if (hdr.identifier != IDENTIFIER || !(hdr.flags & FIN_FLAG_MASK) ||
+        hdr.destination_port != entry->my_port) {
+      continue;
+    }
+    uint16_t hlen = sizeof(ut_tcp_header_t);
+    uint8_t* pkt = create_packet(entry->my_port, ntohs(entry->peer.sin_port),
+                                 entry->seq, entry->ack, hlen, hlen,
+                                 ACK_FLAG_MASK, 0, NULL, 0);
+    if (pkt != NULL) {
+      sendto(entry->fd, pkt, hlen, 0, (struct sockaddr*)&entry->peer,
+             sizeof(entry->peer));
+      free(pkt);
+    }
+  }
+}
+
+static void* reaper_loop(void* arg) {
+  (void)arg;
+  struct pollfd* fds = NULL;
+  ut_reaped_t** entries = NULL;
+  int cap = 0;
+
+  while (1) {
+    int n = 0;
+    int64_t timeout = REAPER_TICK;
+
+    pthread_mutex_lock(&reaper_lock);
+    while (reaped == NULL) {
+      pthread_cond_wait(&reaper_cond, &reaper_lock);
+    }
+    if (reaped_count > cap) {
+      cap = reaped_count * 2;
+      fds = realloc(fds, cap * sizeof(struct pollfd));
+      entries = realloc(entries, cap * sizeof(ut_reaped_t*));
+      if (fds == NULL || entries == NULL) {
+        perror("ERROR reaper out of memory");
+        abort();
+      }
+    }
+    for (ut_reaped_t* entry = reaped; entry != NULL; entry = entry->next) {
+      fds[n].fd = entry->fd;
+      fds[n].events = POLLIN;
+      entries[n++] = entry;
+      if (entry->deadline - ut_now_ms() < timeout) {
+        timeout = entry->deadline - ut_now_ms();
+      }
+    }
+    pthread_mutex_unlock(&reaper_lock);
+
+    // Only this thread removes entries, so they stay valid while unlocked.
+    if (poll(fds, n, timeout < 0 ? 0 : timeout) > 0) {
+      for (int i = 0; i < n; i++) {
+        if (fds[i].revents & POLLIN) {
+          answer(entries[i]);
+        }
+      }
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    for (ut_reaped_t** link = &reaped; *link != NULL;) {
+      ut_reaped_t* entry = *link;
+      if (entry->deadline > ut_now_ms()) {
+        link = &entry->next;
+        continue;
+      }
+      *link = entry->next;
+      reaped_count--;
+      close(entry->fd);
+      if (entry->owned != NULL) {
+        ut_free_state(entry->owned);
+        free(entry->owned);
+      }
+      free(entry);
+    }
+    pthread_mutex_unlock(&reaper_lock);
+  }
+  return NULL;
+}
+
+static void reaper_start(void) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, reaper_loop, NULL);
+  pthread_detach(thread);
+}
+
+void ut_reaper_add(int fd, const struct sockaddr_in* peer, uint16_t my_port,
+                   uint32_t seq, uint32_t ack, ut_socket_t* owned) {
+  ut_reaped_t* entry = malloc(sizeof(ut_reaped_t));
+
+  if (entry == NULL) {
+    // Skip TIME_WAIT rather than leak the connection.
+    close(fd);
+    if (owned != NULL) {
+      ut_free_state(owned);
+      free(owned);
+    }
+    return;
+  }
+  entry->fd = fd;
+  entry->peer = *peer;
+  entry->my_port = my_port;
+  entry->seq = seq;
+  entry->ack = ack;
+  entry->owned = owned;
+  entry->deadline = ut_now_ms() + TIME_WAIT_TIMEOUT;
+
+  pthread_once(&reaper_once, reaper_start);
+  pthread_mutex_lock(&reaper_lock);
+  entry->next = reaped;
+  reaped = entry;
+  reaped_count++;
+  pthread_cond_signal(&reaper_cond);
+  pthread_mutex_unlock(&reaper_lock);
+}
@@ -0,0 +1,376 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#include "ut_stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ut_cc.h"
+
+#define SLOT(size, off) ((off) & ((size) - 1))
+
+static ut_stream_tx_t *lookup_tx(ut_socket_t *sock, uint16_t id) {
+  ut_stream_tx_t *tx;
+
+  for (tx = sock->send_streams; tx != NULL; tx = tx->next) {
+    if (tx->id == id) {
+      return tx;
+    }
+  }
+  return NULL;
+}
+
+static ut_stream_tx_t *find_tx(ut_socket_t *sock, uint16_t id) {
+  ut_stream_tx_t *tx = lookup_tx(sock, id);
+
+  if (tx != NULL) {
+    return tx;
+  }
+  tx = malloc(sizeof(ut_stream_tx_t));
+  if (tx == NULL) {
+    return NULL;
+  }
+  // Like the connection rings, on the backend's node.
+  tx->buf = ut_cpu_alloc(sock->recv_ring_size, sock->opts.cpu);
+  if (tx->buf == NULL) {
+    free(tx);
+    return NULL;
+  }
+  tx->id = id;
+  tx->next_off = 0;
+  tx->next_send = 0;
+  tx->sent_max = 0;
+  tx->acked = 0;
+  // Until the peer advertises a window, assume its ring is as large as ours.
+  tx->peer_win = sock->opts.recv_buf;
+  tx->next = sock->send_streams;
+  sock->send_streams = tx;
+  return tx;
+}
+
+static ut_stream_rx_t *lookup_rx(ut_socket_t *sock, uint16_t id) {
+  ut_stream_rx_t *rx;
+
+  for (rx = sock->recv_streams; rx != NULL; rx = rx->next) {
+    if (rx->id == id) {
+      return rx;
+    }
+  }
+  return NULL;
+}
+
+static ut_stream_rx_t *find_rx(ut_socket_t *sock, uint16_t id) {
+  ut_stream_rx_t *rx = lookup_rx(sock, id);
+
+  if (rx != NULL) {
+    return rx;
+  }
+  rx = malloc(sizeof(ut_stream_rx_t));
+  if (rx == NULL) {
+    return NULL;
+  }
+  rx->buf = ut_cpu_alloc(sock->recv_ring_size, sock->opts.cpu);
+  rx->present = calloc(sock->recv_ring_size / 64, sizeof(uint64_t));
+  if (rx->buf == NULL || rx->present == NULL) {
+    ut_cpu_free(rx->buf, sock->recv_ring_size);
+    free(rx->present);
+    free(rx);
+    return NULL;
+  }
+  rx->id = id;
+  rx->next_read = 0;
+  rx->next_expect = 0;
+  rx->recv_max = 0;
+  rx->next = sock->recv_streams;
+  sock->recv_streams = rx;
+  return rx;
+}
+
+static int valid_id(uint16_t stream_id) {
+  return stream_id != 0 && stream_id <= UT_MAX_STREAMS;
+}
+
+int ut_stream_write(ut_socket_t *sock, uint16_t stream_id, const void *buf,
+                    int length) {
+  const uint8_t *src = buf;
+  ut_stream_tx_t *tx;
+
+  if (atomic_load_explicit(&sock->dying, memory_order_acquire) ||
+      !valid_id(stream_id) || length < 0) {
+    return EXIT_ERROR;
+  }
+
+  pthread_mutex_lock(&(sock->send_lock));
+
+  tx = find_tx(sock, stream_id);
+  if (tx == NULL) {
+    pthread_mutex_unlock(&(sock->send_lock));
+    return EXIT_ERROR;
+  }
+
+  // The copy happens under the lock, so concurrent writers never claim the
+  // same stream offsets. The lock is only dropped while waiting for space,
+  // and a write that fits in the ring waits until it fits whole.
+  while (length > 0) {
+    uint32_t space = sock->recv_ring_size - (tx->next_off - tx->acked);
+    uint32_t want = (uint32_t)length < sock->recv_ring_size
+                        ? (uint32_t)length
+                        : sock->recv_ring_size;
+    uint32_t n;
+
+    if (space < want) {
+      pthread_cond_wait(&(sock->send_cond), &(sock->send_lock));
+      continue;
+    }
+    n = (uint32_t)length < space ? (uint32_t)length : space;
+    ring_copy_in(tx->buf, sock->recv_ring_size, tx->next_off, src, n);
+    tx->next_off += n;
+    src += n;
+    length -= n;
+  }
+
+  pthread_mutex_unlock(&(sock->send_lock));
+  return EXIT_SUCCESS;
+}
+
+int ut_stream_read(ut_socket_t *sock, uint16_t stream_id, void *buf,
+                   int length, ut_read_mode_t flags) {
+  ut_stream_rx_t *rx;
+  uint32_t avail;
+  int read_len = 0;
+
+  if (length < 0 || !valid_id(stream_id)) {
+    return EXIT_ERROR;
+  }
+  pthread_mutex_lock(&(sock->recv_lock));
+
+  rx = find_rx(sock, stream_id);
+  if (rx == NULL) {
+    pthread_mutex_unlock(&(sock->recv_lock));
+    return EXIT_ERROR;
+  }
+
+  switch (flags) {
+    case NO_FLAG:
+      while (rx->next_expect == rx->next_read) {
+        pthread_cond_wait(&(sock->wait_cond), &(sock->recv_lock));
+      }
+    // Fall through.
+    case NO_WAIT:
+      avail = rx->next_expect - rx->next_read;
+      read_len = avail > (uint32_t)length ? length : (int)avail;
+      ring_copy_out(rx->buf, sock->recv_ring_size, rx->next_read, buf, read_len);
+      rx->next_read += read_len;
+      break;
+    default:
+      perror("ERROR Unknown flag.\n");
+      read_len = EXIT_ERROR;
+  }
+  pthread_mutex_unlock(&(sock->recv_lock));
+  return read_len;
+}
+
+uint32_t ut_stream_next(ut_socket_t *sock, uint32_t max_len,
+                        uint16_t *stream_id, uint32_t *stream_off,
+                        uint8_t *dst) {
+  ut_stream_tx_t *start = sock->send_streams_next;
+  ut_stream_tx_t *tx;
+
+  if (start == NULL) {
+    start = sock->send_streams;
+  }
+  tx = start;
+  while (tx != NULL) {
+    uint32_t limit = tx->acked + tx->peer_win;
+    uint32_t n = tx->next_off - tx->next_send;
+
+    if (!after(limit, tx->next_send)) {
+      n = 0;
+    } else if (n > limit - tx->next_send) {
+      n = limit - tx->next_send;
+    }
+    if (n > max_len) {
+      n = max_len;
+    }
+    if (n > 0) {
+      ring_copy_out(tx->buf, sock->recv_ring_size, tx->next_send, dst, n);
+      *stream_id = tx->id;
+      *stream_off = tx->next_send;
+      tx->next_send += n;
+      if (after(tx->next_send, tx->sent_max)) {
+        tx->sent_max = tx->next_send;
+      }
+      sock->send_streams_next = tx->next;
+      return n;
+    }
+    tx = tx->next != NULL ? tx->next : sock->send_streams;
+    if (tx == start) {
+      break;
+    }
+  }
+  return 0;
+}
+
+void ut_stream_ack(ut_socket_t *sock, uint16_t stream_id, uint32_t ack,
+                   uint16_t window) {
+  ut_stream_tx_t *tx = lookup_tx(sock, stream_id);
+
+  // Ignore acknowledgements of data that was never sent.
+  if (tx == NULL || !between(ack, tx->acked, tx->sent_max)) {
+    return;
+  }
+  tx->peer_win = window;
+  if (ack == tx->acked) {
+    return;
+  }
+  ut_cc_on_ack(sock, ack - tx->acked);
+  tx->acked = ack;
+  if (before(tx->next_send, ack)) {
+    tx->next_send = ack;
+  }
+  pthread_cond_broadcast(&(sock->send_cond));
+}
+
+void ut_stream_rewind(ut_socket_t *sock) {
+  for (ut_stream_tx_t *tx = sock->send_streams; tx != NULL; tx = tx->next) {
+    tx->next_send = tx->acked;
+  }
+}
+
+uint32_t ut_stream_in_flight(ut_socket_t *sock) {
+  uint32_t total = 0;
+
+  for (ut_stream_tx_t *tx = sock->send_streams; tx != NULL; tx = tx->next) {
+    total += tx->next_send - tx->acked;
+  }
+  return total;
+}
+
+/*
+ * Sets or clears the bits of `len` bytes from `off`, a word at a time. The
+ * ring size is a power of two of at least 64, so words never straddle the
+ * end of the ring.
+ */
+static void mark(uint64_t *present, uint32_t size, uint32_t off, uint32_t len,
+                 int set) {
+  uint32_t slot = SLOT(size, off);
+
+  while (len > 0) {
+    uint32_t bit = slot % 64;
+    uint32_t n = len < 64 - bit ? len : 64 - bit;
+    uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
+
+    if (set) {
+      present[slot / 64] |= mask;
+    } else {
+      present[slot / 64] &= ~mask;
+    }
+    slot = SLOT(size, slot + n);
+    len -= n;
+  }
+}
+
+/*
+ * Counts the bytes present from `off` onwards, stopping at the first
+ * missing one or after `limit`.
+ */
+static uint32_t present_run(const uint64_t *present, uint32_t size,
+                            uint32_t off, uint32_t limit) {
+  uint32_t slot = SLOT(size, off);
+  uint32_t run = 0;
+
+  while (run < limit) {
+    uint32_t bit = slot % 64;
+    // Bits shifted in from the top are zero, so the scan stops at the end
+    // of the word at the latest.
+    uint64_t missing = ~(present[slot / 64] >> bit);
+    uint32_t n = missing == 0 ? 64 : __builtin_ctzll(missing);
+
+    run += n;
+    if (n < 64 - bit) {
+      break;
+    }
+    slot = SLOT(size, slot + n);
+  }
+  return run < limit ? run : limit;
+}
+
+uint32_t ut_stream_deliver(ut_socket_t *sock, uint16_t stream_id,
+                           uint32_t stream_off, const uint8_t *payload,
+                           uint32_t len) {
+  ut_stream_rx_t *rx;
+  uint32_t accepted = len;
+  bool ooo_pending;
+
+  if (!valid_id(stream_id) || (rx = find_rx(sock, stream_id)) == NULL) {
+    return 0;
+  }
+  if (after(stream_off + len, rx->next_read + sock->opts.recv_buf)) {
+    return 0;
+  }
+  if (!after(stream_off + len, rx->next_expect)) {
+    return accepted;
+  }
+  if (before(stream_off, rx->next_expect)) {
+    payload += rx->next_expect - stream_off;
+    len -= rx->next_expect - stream_off;
+    stream_off = rx->next_expect;
+  }
+
+  ring_copy_in(rx->buf, sock->recv_ring_size, stream_off, payload, len);
+  ooo_pending = after(rx->recv_max, rx->next_expect);
+  if (after(stream_off + len, rx->recv_max)) {
+    rx->recv_max = stream_off + len;
+  }
+
+  if (stream_off != rx->next_expect) {
+    mark(rx->present, sock->recv_ring_size, stream_off, len, 1);
+  } else if (!ooo_pending) {
+    rx->next_expect += len;
+  } else {
+    // This fills a hole: clear what it covers and pull in whatever
+    // out-of-order data is now contiguous.
+    uint32_t run;
+
+    mark(rx->present, sock->recv_ring_size, stream_off, len, 0);
+    rx->next_expect += len;
+    run = present_run(rx->present, sock->recv_ring_size, rx->next_expect,
+                      rx->recv_max - rx->next_expect);
+    mark(rx->present, sock->recv_ring_size, rx->next_expect, run, 0);
+    rx->next_expect += run;
+  }
+  return accepted;
+}
+
+int ut_stream_ack_info(ut_socket_t *sock, uint16_t stream_id, uint32_t *ack,
+                       uint16_t *window) {
+  ut_stream_rx_t *rx = lookup_rx(sock, stream_id);
+
+  if (rx == NULL) {
+    return EXIT_ERROR;
+  }
+  *ack = rx->next_expect;
+  *window = sock->opts.recv_buf - (rx->next_expect - rx->next_read);
+  return EXIT_SUCCESS;
+}
+
+void ut_stream_free_all(ut_socket_t *sock) {
+  while (sock->send_streams != NULL) {
+    ut_stream_tx_t *tx = sock->send_streams;
+    sock->send_streams = tx->next;
+    ut_cpu_free(tx->buf, sock->recv_ring_size);
+    free(tx);
+  }
+  sock->send_streams_next = NULL;
+  while (sock->recv_streams != NULL) {
+    ut_stream_rx_t *rx = sock->recv_streams;
+    sock->recv_streams = rx->next;
+    ut_cpu_free(rx->buf, sock->recv_ring_size);
+    free(rx->present);
+    free(rx);
+  }
+}
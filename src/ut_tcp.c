@@ -3,50 +3,314 @@
  * Copyright (C) 2025 University of Texas at Austin
  */
 
+#define _GNU_SOURCE
+
 #include "ut_tcp.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "backend.h"
+#include "ut_cache.h"
+#include "ut_cc.h"
+#include "ut_pmtu.h"
+#include "ut_reaper.h"
+#include "ut_stream.h"
+#include "ut_time.h"
+
+/*
+ * Starts an initiator from what the last connection to the same listener
+ * learned: its path metrics, and a fast-open cookie so the first data can
+ * ride on the SYN instead of waiting a round trip.
+ */
+static void seed_from_cache(ut_socket_t *sock) {
+  ut_cache_entry_t entry;
+
+  if (!ut_cache_lookup(&sock->conn, &entry)) {
+    return;
+  }
+  if (entry.have_metrics) {
+    // The path may have changed since, so the cached window is only a hint
+    // (RFC 9040): it may not exceed the cached threshold or a few initial
+    // windows.
+    uint32_t cap = CACHE_MAX_WINDOW_SCALE * sock->cong_win;
+    uint32_t win = entry.cong_win;
+
+    sock->srtt = entry.srtt;
+    if (entry.slow_start_thresh >= ut_mss(sock)) {
+      sock->slow_start_thresh = entry.slow_start_thresh;
+      if (cap > entry.slow_start_thresh) {
+        cap = entry.slow_start_thresh;
+      }
+    }
+    if (win > cap) {
+      win = cap;
+    }
+    if (win > sock->cong_win) {
+      sock->cong_win = win;
+    }
+  }
+  if (entry.have_cookie) {
+    sock->fast_open = 1;
+    sock->cookie = entry.cookie;
+  }
+}
+
+/*
+ * Reads a numeric option from the environment, keeping `def` if the variable
+ * is unset, not a number, or outside `min` to `max`.
+ */
+static uint32_t env_uint(const char *name, uint32_t def, uint32_t min,
+                         uint32_t max) {
+  const char *value = getenv(name);
+  char *end;
+  unsigned long n;
+
+  if (value == NULL) {
+    return def;
+  }
+  n = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || n < min || n > max) {
+    return def;
+  }
+  return n;
+}
+
+void ut_socket_opts_init(ut_socket_opts_t *opts) {
+  const char *value;
+  uint32_t rto_max = 64 * DEFAULT_TIMEOUT;
+
+  // The ranges are the ones `ut_socket_ex` checks, so a bad variable falls
+  // back to its default rather than making every socket fail.
+  opts->mtu = env_uint("UT_TCP_MTU", MAX_LEN + UT_IP_UDP_OVERHEAD, UT_MTU_MIN,
+                       UT_MTU_MAX);
+  // Path MTU probing is opt-in.
+  opts->max_mtu = env_uint("UT_TCP_MAX_MTU", opts->mtu, opts->mtu, UT_MTU_MAX);
+  opts->init_window = env_uint("UT_TCP_INIT_WINDOW", 0, 0, UINT32_MAX);
+  opts->ssthresh = env_uint("UT_TCP_SSTHRESH", 0, 0, UINT32_MAX);
+  opts->recv_buf = env_uint("UT_TCP_RECV_BUF", MAX_NETWORK_BUFFER,
+                            opts->max_mtu - UT_IP_UDP_OVERHEAD,
+                            MAX_NETWORK_BUFFER);
+  opts->send_buf = env_uint("UT_TCP_SEND_BUF", UT_DEFAULT_SEND_BUF, 1,
+                            1U << 30);
+  opts->rto_min = env_uint("UT_TCP_RTO_MIN", DEFAULT_TIMEOUT, 1, UINT32_MAX);
+  if (rto_max < opts->rto_min) {
+    rto_max = opts->rto_min;
+  }
+  opts->rto_max = env_uint("UT_TCP_RTO_MAX", rto_max, opts->rto_min,
+                           UINT32_MAX);
+  opts->ack_policy = UT_ACK_IMMEDIATE;
+  value = getenv("UT_TCP_ACK");
+  if (value != NULL && strcmp(value, "delayed") == 0) {
+    opts->ack_policy = UT_ACK_DELAYED;
+  }
+  opts->ack_delay = env_uint("UT_TCP_ACK_DELAY", DEFAULT_TIMEOUT / 5, 0,
+                             UINT32_MAX);
+  opts->cc = UT_CC_RENO;
+  value = getenv("UT_TCP_CC");
+  if (value != NULL && strcmp(value, "cubic") == 0) {
+    opts->cc = UT_CC_CUBIC;
+  }
+  // Checksums are opt-in: they cost CPU on paths where UDP already checks.
+  opts->checksum = env_uint("UT_TCP_CHECKSUM", 0, 0, UINT32_MAX) != 0;
+  opts->cpu = ut_cpu_pick();
+}
+
+/*
+ * Returns the smallest power of two that is at least `n`.
+ */
+static uint32_t pow2_at_least(uint32_t n) {
+  uint32_t size = 1;
+
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+/*
+ * Scales a grading.h window, given in units of the default MSS, to the MSS
+ * of the socket.
+ */
+static uint32_t scale_window(uint32_t window, uint32_t mss) {
+  return (uint64_t)window * mss / MSS;
+}
+
+/*
+ * Collects the socket's mutexes and condition variables, in the order they
+ * are initialized.
+ */
+static void sync_objects(ut_socket_t *sock, pthread_mutex_t *mutexes[],
+                         pthread_cond_t *conds[]) {
+  mutexes[0] = &sock->recv_lock;
+  mutexes[1] = &sock->send_lock;
+  mutexes[2] = &sock->write_lock;
+  mutexes[3] = &sock->read_lock;
+  mutexes[4] = &sock->death_lock;
+  conds[0] = &sock->wait_cond;
+  conds[1] = &sock->send_cond;
+  conds[2] = &sock->death_cond;
+}
+
+#define SOCK_MUTEXES 5
+#define SOCK_CONDS 3
+
+/*
+ * Destroys the first `n_mutexes` mutexes and `n_conds` condition variables
+ * listed by `sync_objects`.
+ */
+static void destroy_sync(ut_socket_t *sock, int n_mutexes, int n_conds) {
+  pthread_mutex_t *mutexes[SOCK_MUTEXES];
+  pthread_cond_t *conds[SOCK_CONDS];
+
+  sync_objects(sock, mutexes, conds);
+  while (n_conds-- > 0) {
+    pthread_cond_destroy(conds[n_conds]);
+  }
+  while (n_mutexes-- > 0) {
+    pthread_mutex_destroy(mutexes[n_mutexes]);
+  }
+}
+
+/*
+ * Initializes the socket's mutexes and condition variables. On failure,
+ * those already initialized are destroyed again.
+ */
+static int init_sync(ut_socket_t *sock) {
+  pthread_mutex_t *mutexes[SOCK_MUTEXES];
+  pthread_cond_t *conds[SOCK_CONDS];
+  int m, c;
+
+  sync_objects(sock, mutexes, conds);
+  for (m = 0; m < SOCK_MUTEXES; m++) {
+    if (pthread_mutex_init(mutexes[m], NULL) != 0) {
+      destroy_sync(sock, m, 0);
+      return EXIT_ERROR;
+    }
+  }
+  for (c = 0; c < SOCK_CONDS; c++) {
+    if (pthread_cond_init(conds[c], NULL) != 0) {
+      destroy_sync(sock, SOCK_MUTEXES, c);
+      return EXIT_ERROR;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Undoes a partly set up `ut_socket_ex` once its buffers are allocated and
+ * its locks initialized: reports `msg` and releases everything.
+ */
+static int socket_fail(ut_socket_t *sock, const char *msg) {
+  perror(msg);
+  destroy_sync(sock, SOCK_MUTEXES, SOCK_CONDS);
+  ut_free_state(sock);
+  close(sock->socket);
+  return EXIT_ERROR;
+}
 
 int ut_socket(ut_socket_t *sock, const ut_socket_type_t socket_type,
                const int port, const char *server_ip) {
+  return ut_socket_ex(sock, socket_type, port, server_ip, NULL);
+}
+
+int ut_socket_ex(ut_socket_t *sock, const ut_socket_type_t socket_type,
+                 const int port, const char *server_ip,
+                 const ut_socket_opts_t *opts) {
   int sockfd, optval;
   socklen_t len;
   struct sockaddr_in conn, my_addr;
+  pthread_attr_t attr;
+  uint32_t base_mss;
+  int err;
   len = sizeof(my_addr);
 
+  if (opts != NULL) {
+    sock->opts = *opts;
+  } else {
+    ut_socket_opts_init(&sock->opts);
+  }
+  if (sock->opts.mtu < UT_MTU_MIN || sock->opts.mtu > sock->opts.max_mtu ||
+      sock->opts.max_mtu > UT_MTU_MAX ||
+      sock->opts.recv_buf < sock->opts.max_mtu - UT_IP_UDP_OVERHEAD ||
+      sock->opts.recv_buf > MAX_NETWORK_BUFFER ||
+      sock->opts.send_buf == 0 || sock->opts.send_buf > (1U << 30) ||
+      sock->opts.rto_min == 0 || sock->opts.rto_min > sock->opts.rto_max) {
+    perror("ERROR invalid socket options");
+    return EXIT_ERROR;
+  }
+  if (socket_type != TCP_INITIATOR && socket_type != TCP_LISTENER) {
+    perror("Unknown Flag");
+    return EXIT_ERROR;
+  }
+  if (socket_type == TCP_INITIATOR && server_ip == NULL) {
+    perror("ERROR server_ip NULL");
+    return EXIT_ERROR;
+  }
+  atomic_init(&sock->max_len, sock->opts.mtu - UT_IP_UDP_OVERHEAD);
+  sock->recv_ring_size = pow2_at_least(sock->opts.recv_buf + 1);
+  sock->send_ring_size = pow2_at_least(sock->opts.send_buf);
+
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd < 0) {
     perror("ERROR opening socket");
     return EXIT_ERROR;
   }
   sock->socket = sockfd;
-  sock->received_buf = NULL;
-  sock->received_len = 0;
-  pthread_mutex_init(&(sock->recv_lock), NULL);
-
-  sock->sending_buf = NULL;
-  sock->sending_len = 0;
-  pthread_mutex_init(&(sock->send_lock), NULL);
+  ut_pmtu_init(sock);
+  sock->recv_msg_len = -1;
+  sock->recv_msg_skip = 0;
+  sock->recv_streams = NULL;
+  sock->send_regions = NULL;
+  sock->send_regions_tail = NULL;
+  sock->send_streams = NULL;
+  sock->send_streams_next = NULL;
+  // The rings live on the backend's node: it touches every byte of them.
+  sock->received_buf = ut_cpu_alloc(sock->recv_ring_size, sock->opts.cpu);
+  sock->sending_buf = ut_cpu_alloc(sock->send_ring_size, sock->opts.cpu);
+  if (sock->received_buf == NULL || sock->sending_buf == NULL) {
+    perror("ERROR allocating socket buffers");
+    ut_free_state(sock);
+    close(sockfd);
+    return EXIT_ERROR;
+  }
+  if (init_sync(sock) < 0) {
+    perror("ERROR initializing socket locks");
+    ut_free_state(sock);
+    close(sockfd);
+    return EXIT_ERROR;
+  }
+  atomic_init(&sock->sending_head, 0);
+  atomic_init(&sock->sending_tail, 0);
+  atomic_init(&sock->send_waiting, false);
 
   sock->type = socket_type;
-  sock->dying = 0;
-  pthread_mutex_init(&(sock->death_lock), NULL);
+  atomic_init(&sock->dying, 0);
+  sock->linger = UT_LINGER_BACKGROUND;
+  sock->abort = 0;
+  sock->handoff_req = 0;
+  sock->detached = 0;
+  sock->handoff = NULL;
+  sock->close_state = UT_OPEN;
 
   srand(time(NULL)); // Seed the random number generator
   sock->send_win.last_ack = rand() % 10000;
   sock->send_win.last_sent = sock->send_win.last_ack;
-  sock->send_win.last_write = sock->send_win.last_ack + 1;
+  atomic_init(&sock->send_win.last_write, sock->send_win.last_ack + 1);
+  sock->sending_seq = sock->send_win.last_write;
 
-  sock->recv_win.last_read = 0;
-  sock->recv_win.next_expect = 1;
+  atomic_init(&sock->recv_win.last_read, 0);
+  atomic_init(&sock->recv_win.next_expect, 1);
+  atomic_init(&sock->recv_waiting, false);
   sock->recv_win.last_recv = 0;
 
   sock->complete_init = 0;
@@ -54,34 +318,41 @@ int ut_socket(ut_socket_t *sock, const ut_socket_type_t socket_type,
   sock->recv_fin = 0;
   sock->fin_acked = 0;
   sock->dup_ack_count = 0;
-  sock->cong_win = WINDOW_INITIAL_WINDOW_SIZE;
-  sock->slow_start_thresh = WINDOW_INITIAL_SSTHRESH;
-
-  if (pthread_cond_init(&sock->wait_cond, NULL) != 0) {
-    perror("ERROR condition variable not set\n");
-    return EXIT_ERROR;
-  }
+  sock->ack_pending = 0;
+  sock->ack_deadline = 0;
+  sock->csum_wanted = sock->opts.checksum;
+  sock->csum_enabled = 0;
+  sock->csum_drops = 0;
+  base_mss = sock->opts.mtu - UT_IP_UDP_OVERHEAD - sizeof(ut_tcp_header_t);
+  sock->cong_win = sock->opts.init_window
+                       ? sock->opts.init_window
+                       : scale_window(WINDOW_INITIAL_WINDOW_SIZE, base_mss);
+  sock->slow_start_thresh = sock->opts.ssthresh
+                                ? sock->opts.ssthresh
+                                : scale_window(WINDOW_INITIAL_SSTHRESH, base_mss);
+  sock->srtt = 0;
+  sock->cc_w_max = 0;
+  sock->cc_k = 0;
+  sock->cc_epoch = 0;
+  sock->fast_open = 0;
+  sock->cookie = 0;
 
   switch (socket_type) {
     case TCP_INITIATOR:
       sock->send_syn = 1;
 
-      if (server_ip == NULL) {
-        perror("ERROR server_ip NULL");
-        return EXIT_ERROR;
-      }
       memset(&conn, 0, sizeof(conn));
       conn.sin_family = AF_INET;
       conn.sin_addr.s_addr = inet_addr(server_ip);
       conn.sin_port = htons(port);
       sock->conn = conn;
+      seed_from_cache(sock);
 
       my_addr.sin_family = AF_INET;
       my_addr.sin_addr.s_addr = htonl(INADDR_ANY);
       my_addr.sin_port = 0;
       if (bind(sockfd, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
-        perror("ERROR on binding");
-        return EXIT_ERROR;
+        return socket_fail(sock, "ERROR on binding");
       }
 
       break;
@@ -98,114 +369,818 @@ int ut_socket(ut_socket_t *sock, const ut_socket_type_t socket_type,
       setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                  sizeof(int));
       if (bind(sockfd, (struct sockaddr *)&conn, sizeof(conn)) < 0) {
-        perror("ERROR on binding");
-        return EXIT_ERROR;
+        return socket_fail(sock, "ERROR on binding");
       }
       sock->conn = conn;
       break;
-
-    default:
-      perror("Unknown Flag");
-      return EXIT_ERROR;
   }
   getsockname(sockfd, (struct sockaddr *)&my_addr, &len);
   sock->my_port = ntohs(my_addr.sin_port);
 
-  pthread_create(&(sock->thread_id), NULL, begin_backend, (void *)sock);
+  pthread_attr_init(&attr);
+  if (ut_cpu_bind_attr(&attr, sock->opts.cpu) < 0) {
+    sock->opts.cpu = -1;
+  }
+  err = pthread_create(&(sock->thread_id), &attr, begin_backend, (void *)sock);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    errno = err;
+    return socket_fail(sock, "ERROR starting backend thread");
+  }
   return EXIT_SUCCESS;
 }
 
+/*
+ * Returns the CLOCK_REALTIME time `ms` from now, for
+ * `pthread_cond_timedwait`.
+ */
+static struct timespec deadline_in(int ms) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Waits on `death_cond` until it is signaled, `deadline` passes or
+ * UT_CLOSE_POLL ms go by. Then checks whether the backend thread exited
+ * without reporting the close, e.g. because it failed, and joins it if so.
+ * Must be called with `death_lock` held. A backend that took the handoff
+ * has detached itself and is not checked.
+ *
+ * Returns true if the backend thread was joined.
+ */
+static bool close_wait(ut_socket_t *sock, const struct timespec *deadline) {
+  struct timespec slice = deadline_in(UT_CLOSE_POLL);
+
+  if (ts_before(deadline, &slice)) {
+    slice = *deadline;
+  }
+  pthread_cond_timedwait(&(sock->death_cond), &(sock->death_lock), &slice);
+  return sock->handoff == NULL &&
+         pthread_tryjoin_np(sock->thread_id, NULL) == 0;
+}
+
 int ut_close(ut_socket_t *sock) {
-  while (pthread_mutex_lock(&(sock->death_lock)) != 0) {
+  struct timespec deadline, now;
+  bool joined = false;
+
+  if (sock == NULL) {
+    perror("ERROR null socket\n");
+    return EXIT_ERROR;
   }
-  sock->dying = 1;
-  pthread_mutex_unlock(&(sock->death_lock));
 
-  pthread_join(sock->thread_id, NULL);
+  pthread_mutex_lock(&(sock->death_lock));
+  atomic_store_explicit(&sock->dying, 1, memory_order_release);
 
-  if (sock != NULL) {
-    if (sock->received_buf != NULL) {
-      free(sock->received_buf);
+  if (sock->linger == UT_LINGER_BACKGROUND && sock->close_state == UT_OPEN) {
+    deadline = deadline_in(UT_HANDOFF_TIMEOUT);
+    sock->handoff_req = 1;
+    while (sock->handoff_req && !joined) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (!ts_before(&now, &deadline)) {
+        // The backend is not taking the connection over; withdraw the
+        // request and wait for it to finish the close itself.
+        sock->handoff_req = 0;
+        break;
+      }
+      joined = close_wait(sock, &deadline);
+    }
+    sock->handoff_req = 0;
+    if (sock->handoff != NULL) {
+      // The backend runs on its own copy now and cleans up after itself.
+      pthread_mutex_unlock(&(sock->death_lock));
+      return EXIT_SUCCESS;
     }
-    if (sock->sending_buf != NULL) {
-      free(sock->sending_buf);
+  } else if (sock->linger > 0) {
+    deadline = deadline_in(sock->linger);
+    while (sock->close_state == UT_OPEN && !joined) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (!ts_before(&now, &deadline)) {
+        break;
+      }
+      joined = close_wait(sock, &deadline);
+    }
+    if (sock->close_state == UT_OPEN) {
+      sock->abort = 1;
     }
   } else {
-    perror("ERROR null socket\n");
-    return EXIT_ERROR;
+    sock->abort = 1;
+  }
+  pthread_mutex_unlock(&(sock->death_lock));
+
+  if (!joined) {
+    pthread_join(sock->thread_id, NULL);
+  }
+  ut_free_state(sock);
+
+  if (sock->close_state == UT_TIME_WAIT) {
+    ut_reaper_add(sock->socket, &sock->conn, sock->my_port,
+                  sock->send_fin_seq + 1, sock->recv_fin_seq + 1, NULL);
+    return EXIT_SUCCESS;
   }
   return close(sock->socket);
 }
 
-int ut_read(ut_socket_t *sock, void *buf, int length, ut_read_mode_t flags) {
-  uint8_t *new_buf;
-  int read_len = 0;
+void ut_set_linger(ut_socket_t *sock, int linger_ms) {
+  pthread_mutex_lock(&(sock->death_lock));
+  sock->linger = linger_ms < 0 ? UT_LINGER_BACKGROUND : linger_ms;
+  pthread_mutex_unlock(&(sock->death_lock));
+}
 
-  if (length < 0) {
-    perror("ERROR negative length");
-    return EXIT_ERROR;
+void ut_free_state(ut_socket_t *sock) {
+  ut_cpu_free(sock->received_buf, sock->recv_ring_size);
+  sock->received_buf = NULL;
+  ut_cpu_free(sock->sending_buf, sock->send_ring_size);
+  sock->sending_buf = NULL;
+  while (sock->send_regions != NULL) {
+    ut_send_region_t *region = sock->send_regions;
+    sock->send_regions = region->next;
+    close(region->fd);
+    free(region);
   }
-  while (pthread_mutex_lock(&(sock->recv_lock)) != 0) {
+  sock->send_regions_tail = NULL;
+  ut_stream_free_all(sock);
+}
+
+ut_socket_t *ut_backend_handoff(ut_socket_t *sock) {
+  ut_socket_t *copy;
+
+  pthread_mutex_lock(&(sock->death_lock));
+  if (!sock->handoff_req) {
+    pthread_mutex_unlock(&(sock->death_lock));
+    return sock;
+  }
+
+  copy = aligned_alloc(UT_CACHELINE, sizeof(ut_socket_t));
+  if (copy != NULL) {
+    // The copy takes over every buffer; the application's struct is left
+    // with dangling pointers it must no longer use.
+    memcpy(copy, sock, sizeof(ut_socket_t));
+    if (init_sync(copy) < 0) {
+      free(copy);
+      copy = NULL;
+    }
+  }
+  if (copy != NULL) {
+    copy->handoff_req = 0;
+    copy->handoff = NULL;
+    copy->detached = 1;
+    pthread_detach(pthread_self());
+    sock->handoff = copy;
+  }
+  sock->handoff_req = 0;
+  pthread_cond_broadcast(&(sock->death_cond));
+  pthread_mutex_unlock(&(sock->death_lock));
+  return copy != NULL ? copy : sock;
+}
+
+void ut_backend_finish(ut_socket_t *sock) {
+  // Only the backend writes these, so they need no lock, and the cache file
+  // I/O stays out from under `death_lock`. Saved before the close is
+  // reported so the application's next connection finds them.
+  if (sock->type == TCP_INITIATOR && sock->complete_init) {
+    ut_cache_update(&sock->conn, sock->srtt, sock->cong_win,
+                    sock->slow_start_thresh);
+  }
+
+  pthread_mutex_lock(&(sock->death_lock));
+  sock->close_state = UT_TIME_WAIT;
+  // Let a pending background close fall back to joining this thread.
+  sock->handoff_req = 0;
+  pthread_cond_broadcast(&(sock->death_cond));
+  pthread_mutex_unlock(&(sock->death_lock));
+
+  if (sock->detached) {
+    ut_reaper_add(sock->socket, &sock->conn, sock->my_port,
+                  sock->send_fin_seq + 1, sock->recv_fin_seq + 1, sock);
+  }
+}
+
+/*
+ * Returns the number of unread bytes in the receive ring. Only the reading
+ * thread may call this: it owns `last_read`.
+ */
+static uint32_t recv_avail(ut_socket_t *sock) {
+  return atomic_load_explicit(&sock->recv_win.next_expect,
+                              memory_order_acquire) -
+         atomic_load_explicit(&sock->recv_win.last_read,
+                              memory_order_relaxed) -
+         1;
+}
+
+/*
+ * Describes the unread bytes of the receive ring, which may wrap around its
+ * end, as up to two spans.
+ */
+static uint32_t recv_spans(ut_socket_t *sock, struct iovec spans[2]) {
+  uint32_t avail = recv_avail(sock);
+  uint32_t start = (sock->recv_win.last_read + 1) & (sock->recv_ring_size - 1);
+  uint32_t first = sock->recv_ring_size - start;
+
+  if (first > avail) {
+    first = avail;
   }
+  spans[0].iov_base = sock->received_buf + start;
+  spans[0].iov_len = first;
+  spans[1].iov_base = sock->received_buf;
+  spans[1].iov_len = avail - first;
+  return avail;
+}
+
+/*
+ * Hands `length` bytes back to the receive ring.
+ */
+static void recv_consume(ut_socket_t *sock, uint32_t length) {
+  uint32_t last_read =
+      atomic_load_explicit(&sock->recv_win.last_read, memory_order_relaxed);
+  atomic_store_explicit(&sock->recv_win.last_read, last_read + length,
+                        memory_order_release);
+}
 
+/*
+ * Waits according to `flags` until `ready` returns non-zero, and stores its
+ * result in `out`. The lock and condition variable are only touched when
+ * the reader actually has to sleep. Returns -1 on an unknown flag.
+ */
+static int recv_wait(ut_socket_t *sock, ut_read_mode_t flags,
+                     uint32_t (*ready)(ut_socket_t *), uint32_t *out) {
   switch (flags) {
     case NO_FLAG:
-      while ((sock->recv_win.next_expect - sock->recv_win.last_read - 1) == 0) {
+      if ((*out = ready(sock)) != 0) {
+        return EXIT_SUCCESS;
+      }
+      pthread_mutex_lock(&(sock->recv_lock));
+      atomic_store(&sock->recv_waiting, true);
+      // Pairs with the fence in ut_recv_publish: either the backend sees
+      // the flag, or we see its data.
+      atomic_thread_fence(memory_order_seq_cst);
+      while ((*out = ready(sock)) == 0) {
         pthread_cond_wait(&(sock->wait_cond), &(sock->recv_lock));
       }
-    // Fall through.
+      atomic_store(&sock->recv_waiting, false);
+      pthread_mutex_unlock(&(sock->recv_lock));
+      return EXIT_SUCCESS;
     case NO_WAIT:
-      uint32_t avail = sock->recv_win.next_expect - sock->recv_win.last_read - 1;
-      if (avail > 0) {
-        read_len = avail > length ? length : avail;
-        memcpy(buf, sock->received_buf, read_len);
-        if (read_len < sock->received_len) {
-          new_buf = malloc(sock->received_len - read_len);
-          memcpy(new_buf, sock->received_buf + read_len,
-                 sock->received_len - read_len);
-          free(sock->received_buf);
-          sock->received_len -= read_len;
-          sock->received_buf = new_buf;
-          sock->recv_win.last_read += read_len;
-        } else {
-          free(sock->received_buf);
-          sock->received_buf = NULL;
-          sock->received_len = 0; 
-          sock->recv_win.last_read += read_len;
-        }
-      }
-      break;
+      *out = ready(sock);
+      return EXIT_SUCCESS;
     default:
       perror("ERROR Unknown flag.\n");
-      read_len = EXIT_ERROR;
+      return EXIT_ERROR;
+  }
+}
+
+int ut_read(ut_socket_t *sock, void *buf, int length, ut_read_mode_t flags) {
+  struct iovec iov;
+
+  if (length < 0) {
+    perror("ERROR negative length");
+    return EXIT_ERROR;
   }
-  pthread_mutex_unlock(&(sock->recv_lock));
+  iov.iov_base = buf;
+  iov.iov_len = length;
+  return ut_readv(sock, &iov, 1, flags);
+}
+
+int ut_readv(ut_socket_t *sock, const struct iovec *iov, int iovcnt,
+             ut_read_mode_t flags) {
+  struct iovec spans[2];
+  uint32_t avail;
+  size_t length = 0;
+  size_t iov_off = 0;
+  size_t span_off = 0;
+  int read_len = 0;
+
+  if (iovcnt < 0) {
+    perror("ERROR negative iovcnt");
+    return EXIT_ERROR;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  if (length > INT_MAX) {
+    length = INT_MAX;
+  }
+
+  pthread_mutex_lock(&(sock->read_lock));
+  if (recv_wait(sock, flags, recv_avail, &avail) < 0) {
+    read_len = EXIT_ERROR;
+  } else {
+    avail = recv_spans(sock, spans);
+    read_len = avail > length ? (int)length : (int)avail;
+
+    // Walk the ring spans and the caller's fragments side by side.
+    for (int i = 0, s = 0, copied = 0; copied < read_len;) {
+      size_t n = read_len - copied;
+      if (n > iov[i].iov_len - iov_off) {
+        n = iov[i].iov_len - iov_off;
+      }
+      if (n > spans[s].iov_len - span_off) {
+        n = spans[s].iov_len - span_off;
+      }
+      memcpy((uint8_t *)iov[i].iov_base + iov_off,
+             (uint8_t *)spans[s].iov_base + span_off, n);
+      copied += n;
+      iov_off += n;
+      span_off += n;
+      if (iov_off == iov[i].iov_len) {
+        i++;
+        iov_off = 0;
+      }
+      if (span_off == spans[s].iov_len) {
+        s++;
+        span_off = 0;
+      }
+    }
+    recv_consume(sock, read_len);
+  }
+  pthread_mutex_unlock(&(sock->read_lock));
   return read_len;
 }
 
+int ut_recv_zc(ut_socket_t *sock, struct iovec spans[2],
+               ut_read_mode_t flags) {
+  uint32_t avail;
+
+  if (recv_wait(sock, flags, recv_avail, &avail) < 0) {
+    return EXIT_ERROR;
+  }
+  return recv_spans(sock, spans);
+}
+
+int ut_recv_release(ut_socket_t *sock, uint32_t length) {
+  if (length > recv_avail(sock)) {
+    perror("ERROR releasing more than was lent");
+    return EXIT_ERROR;
+  }
+  recv_consume(sock, length);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Returns the number of bytes, prefix included, of the message at the head
+ * of the receive ring if it has fully arrived, 0 if it has not, and
+ * UINT32_MAX if the prefix is not a valid message length. The prefix
+ * is parsed once and cached in `recv_msg_len`, so repeated calls while the
+ * body trickles in are O(1). An invalid message is skipped: its prefix is
+ * consumed at once and its body as it arrives, so the messages after it
+ * are still delivered.
+ */
+static uint32_t recv_msg_ready(ut_socket_t *sock) {
+  uint32_t avail = recv_avail(sock);
+  uint32_t prefix, skip;
+
+  if (sock->recv_msg_skip > 0) {
+    skip = avail < sock->recv_msg_skip ? avail : sock->recv_msg_skip;
+    recv_consume(sock, skip);
+    sock->recv_msg_skip -= skip;
+    if (sock->recv_msg_skip > 0) {
+      return 0;
+    }
+    avail -= skip;
+  }
+  if (sock->recv_msg_len < 0) {
+    if (avail < UT_MSG_HDR_LEN) {
+      return 0;
+    }
+    ring_copy_out(sock->received_buf, sock->recv_ring_size,
+                  sock->recv_win.last_read + 1, (uint8_t *)&prefix,
+                  UT_MSG_HDR_LEN);
+    prefix = ntohl(prefix);
+    // A message that cannot fit in the ring would never complete.
+    if (prefix == 0 || prefix > sock->opts.recv_buf - UT_MSG_HDR_LEN) {
+      recv_consume(sock, UT_MSG_HDR_LEN);
+      sock->recv_msg_skip = prefix;
+      return UINT32_MAX;
+    }
+    sock->recv_msg_len = prefix;
+  }
+  if (avail < UT_MSG_HDR_LEN + (uint32_t)sock->recv_msg_len) {
+    return 0;
+  }
+  return UT_MSG_HDR_LEN + sock->recv_msg_len;
+}
+
+int ut_send_msg(ut_socket_t *sock, const void *buf, int length) {
+  struct iovec iov[2];
+  uint32_t prefix;
+
+  // Bounded by our own receive buffer: a peer with the same options could
+  // not take a larger message.
+  if (length <= 0 ||
+      (uint32_t)length > sock->opts.recv_buf - UT_MSG_HDR_LEN) {
+    perror("ERROR invalid message length");
+    return EXIT_ERROR;
+  }
+  prefix = htonl(length);
+  iov[0].iov_base = &prefix;
+  iov[0].iov_len = UT_MSG_HDR_LEN;
+  iov[1].iov_base = (void *)buf;
+  iov[1].iov_len = length;
+  return ut_writev(sock, iov, 2);
+}
+
+int ut_recv_msg(ut_socket_t *sock, void *buf, int length,
+                ut_read_mode_t flags) {
+  uint32_t total;
+  int msg_len;
+
+  if (length < 0) {
+    perror("ERROR negative length");
+    return EXIT_ERROR;
+  }
+  pthread_mutex_lock(&(sock->read_lock));
+  if (recv_wait(sock, flags, recv_msg_ready, &total) < 0) {
+    pthread_mutex_unlock(&(sock->read_lock));
+    return EXIT_ERROR;
+  }
+
+  if (total == 0) {
+    msg_len = 0;
+  } else if (total == UINT32_MAX) {
+    perror("ERROR message does not fit the receive buffer, skipped");
+    msg_len = EXIT_ERROR;
+  } else if (sock->recv_msg_len > length) {
+    perror("ERROR message larger than buffer");
+    msg_len = EXIT_ERROR;
+  } else {
+    msg_len = sock->recv_msg_len;
+    ring_copy_out(sock->received_buf, sock->recv_ring_size,
+                  sock->recv_win.last_read + 1 + UT_MSG_HDR_LEN, buf, msg_len);
+    recv_consume(sock, total);
+    sock->recv_msg_len = -1;
+  }
+  pthread_mutex_unlock(&(sock->read_lock));
+  return msg_len;
+}
+
 int ut_write(ut_socket_t *sock, const void *buf, int length) {
-  while (pthread_mutex_lock(&(sock->death_lock)) != 0) {
+  struct iovec iov;
+
+  if (length < 0) {
+    perror("ERROR negative length");
+    return EXIT_ERROR;
   }
-  int dying = sock->dying;
-  pthread_mutex_unlock(&(sock->death_lock));
+  iov.iov_base = (void *)buf;
+  iov.iov_len = length;
+  return ut_writev(sock, &iov, 1);
+}
+
+int ut_writev(ut_socket_t *sock, const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
 
-  if (dying) {
+  if (atomic_load_explicit(&sock->dying, memory_order_acquire)) {
     return EXIT_ERROR;
   }
+  if (iovcnt < 0) {
+    perror("ERROR negative iovcnt");
+    return EXIT_ERROR;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > INT_MAX - total) {
+      errno = EINVAL;
+      perror("ERROR vector longer than INT_MAX");
+      return EXIT_ERROR;
+    }
+    total += iov[i].iov_len;
+  }
+  // Held across the whole call, so a message or vector from one thread is
+  // never interleaved with another thread's data.
+  pthread_mutex_lock(&(sock->write_lock));
+  for (int i = 0; i < iovcnt; i++) {
+    ut_send_put(sock, iov[i].iov_base, iov[i].iov_len);
+  }
+  pthread_mutex_unlock(&(sock->write_lock));
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Returns the free space in the send ring. Only the writing thread may call
+ * this: it owns `sending_head`.
+ */
+static uint32_t send_space(ut_socket_t *sock) {
+  return sock->send_ring_size -
+         (atomic_load_explicit(&sock->sending_head, memory_order_relaxed) -
+          atomic_load_explicit(&sock->sending_tail, memory_order_acquire));
+}
+
+void ut_send_put(ut_socket_t *sock, const uint8_t *buf, uint32_t len) {
+  while (len > 0) {
+    uint32_t space = send_space(sock);
+    uint32_t head, n;
+
+    if (space == 0) {
+      pthread_mutex_lock(&(sock->send_lock));
+      atomic_store(&sock->send_waiting, true);
+      atomic_thread_fence(memory_order_seq_cst);
+      while ((space = send_space(sock)) == 0) {
+        pthread_cond_wait(&(sock->send_cond), &(sock->send_lock));
+      }
+      atomic_store(&sock->send_waiting, false);
+      pthread_mutex_unlock(&(sock->send_lock));
+    }
 
-  while (pthread_mutex_lock(&(sock->send_lock)) != 0) {
+    n = len < space ? len : space;
+    head = atomic_load_explicit(&sock->sending_head, memory_order_relaxed);
+    ring_copy_in(sock->sending_buf, sock->send_ring_size, head, buf, n);
+    // The ring position first, so the backend never sees a sequence number
+    // whose bytes it cannot find.
+    atomic_store_explicit(&sock->sending_head, head + n, memory_order_release);
+    atomic_fetch_add_explicit(&sock->send_win.last_write, n,
+                              memory_order_release);
+    buf += n;
+    len -= n;
+  }
+}
+
+int ut_sendfile(ut_socket_t *sock, int fd, off_t offset, size_t len) {
+  ut_send_region_t *head = NULL, *tail = NULL, *region;
+  struct stat st;
+  uint32_t seq;
+
+  if (atomic_load_explicit(&sock->dying, memory_order_acquire)) {
+    return EXIT_ERROR;
   }
+  if (offset < 0 || fstat(fd, &st) < 0) {
+    perror("ERROR invalid file");
+    return EXIT_ERROR;
+  }
+  // A region past EOF could never be read, and would stall the connection.
+  if (!S_ISREG(st.st_mode) || (uint64_t)offset > (uint64_t)st.st_size ||
+      len > (uint64_t)(st.st_size - offset)) {
+    errno = EINVAL;
+    perror("ERROR region outside file");
+    return EXIT_ERROR;
+  }
+  if (len == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  pthread_mutex_lock(&(sock->write_lock));
+  pthread_mutex_lock(&(sock->send_lock));
 
-  if (sock->sending_buf == NULL) {
-    sock->sending_buf = malloc(length);
+  // Every region is set up before any is queued, so a failure leaves
+  // nothing behind and the caller can simply retry.
+  // Regions are capped well below the sequence space so `before`/`after`
+  // stay meaningful across a single region.
+  seq = sock->send_win.last_write;
+  while (len > 0) {
+    uint32_t chunk = len > (1u << 30) ? (1u << 30) : (uint32_t)len;
+
+    region = malloc(sizeof(ut_send_region_t));
+    if (region == NULL || (region->fd = dup(fd)) < 0) {
+      perror("ERROR queueing file region");
+      free(region);
+      while (head != NULL) {
+        region = head;
+        head = region->next;
+        close(region->fd);
+        free(region);
+      }
+      pthread_mutex_unlock(&(sock->send_lock));
+      pthread_mutex_unlock(&(sock->write_lock));
+      return EXIT_ERROR;
+    }
+    region->offset = offset;
+    region->seq = seq;
+    region->len = chunk;
+    region->next = NULL;
+    if (tail == NULL) {
+      head = region;
+    } else {
+      tail->next = region;
+    }
+    tail = region;
+
+    seq += chunk;
+    offset += chunk;
+    len -= chunk;
   }
-  else {
-    sock->sending_buf = realloc(sock->sending_buf, length + sock->sending_len);
+
+  if (sock->send_regions_tail == NULL) {
+    sock->send_regions = head;
+  } else {
+    sock->send_regions_tail->next = head;
   }
-  memcpy(sock->sending_buf + sock->sending_len, buf, length);
-  sock->sending_len += length;
-  sock->send_win.last_write += length;
+  sock->send_regions_tail = tail;
+  atomic_store_explicit(&sock->send_win.last_write, seq, memory_order_release);
 
   pthread_mutex_unlock(&(sock->send_lock));
+  pthread_mutex_unlock(&(sock->write_lock));
   return EXIT_SUCCESS;
 }
+
+int ut_send_fetch(ut_socket_t *sock, uint32_t seq, uint8_t *dst, uint32_t len) {
+  ut_send_region_t *region = sock->send_regions;
+  // Offset of `seq` from the ring tail: every byte since `sending_seq` that
+  // is not file-backed lives in the ring.
+  uint32_t mem_off = seq - sock->sending_seq;
+  uint32_t tail = atomic_load_explicit(&sock->sending_tail, memory_order_relaxed);
+  uint32_t held =
+      atomic_load_explicit(&sock->sending_head, memory_order_acquire) - tail;
+  uint32_t copied = 0;
+
+  while (region != NULL && !after(region->seq + region->len, seq)) {
+    mem_off -= region->len;
+    region = region->next;
+  }
+  if (region != NULL && !before(seq, region->seq)) {
+    mem_off -= seq - region->seq;
+  }
+
+  while (copied < len) {
+    uint32_t cur = seq + copied;
+    uint32_t chunk = len - copied;
+
+    if (region != NULL && !before(cur, region->seq)) {
+      uint32_t skip = cur - region->seq;
+      ssize_t n;
+
+      if (chunk > region->len - skip) {
+        chunk = region->len - skip;
+      }
+      n = pread(region->fd, dst + copied, chunk, region->offset + skip);
+      if (n <= 0) {
+        perror("ERROR reading file region");
+        return EXIT_ERROR;
+      }
+      copied += n;
+      if (skip + n == region->len) {
+        region = region->next;
+      }
+    } else {
+      if (region != NULL && chunk > region->seq - cur) {
+        chunk = region->seq - cur;
+      }
+      if (mem_off + chunk > held) {
+        break;
+      }
+      ring_copy_out(sock->sending_buf, sock->send_ring_size, tail + mem_off,
+                    dst + copied, chunk);
+      mem_off += chunk;
+      copied += chunk;
+    }
+  }
+  return copied;
+}
+
+void ut_send_release(ut_socket_t *sock, uint32_t ack) {
+  uint32_t mem_len, tail, held;
+
+  // Ignore acknowledgements of sequence numbers never sent, which would
+  // otherwise grow the window and release unsent data.
+  if (!after(ack, sock->sending_seq) ||
+      after(ack, sock->send_win.last_sent + 1)) {
+    return;
+  }
+  mem_len = ack - sock->sending_seq;
+  ut_cc_on_ack(sock, mem_len);
+  sock->dup_ack_count = 0;
+
+  while (sock->send_regions != NULL && before(sock->send_regions->seq, ack)) {
+    ut_send_region_t *region = sock->send_regions;
+    uint32_t drop = ack - region->seq;
+
+    if (drop < region->len) {
+      mem_len -= drop;
+      region->seq += drop;
+      region->offset += drop;
+      region->len -= drop;
+      break;
+    }
+    mem_len -= region->len;
+    sock->send_regions = region->next;
+    if (sock->send_regions == NULL) {
+      sock->send_regions_tail = NULL;
+    }
+    close(region->fd);
+    free(region);
+  }
+
+  tail = atomic_load_explicit(&sock->sending_tail, memory_order_relaxed);
+  held = atomic_load_explicit(&sock->sending_head, memory_order_acquire) - tail;
+  if (mem_len > held) {
+    mem_len = held;
+  }
+  atomic_store_explicit(&sock->sending_tail, tail + mem_len,
+                        memory_order_release);
+  sock->sending_seq = ack;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (mem_len > 0 && atomic_load(&sock->send_waiting)) {
+    pthread_cond_broadcast(&(sock->send_cond));
+  }
+}
+
+bool ut_send_dup_ack(ut_socket_t *sock) {
+  if (++sock->dup_ack_count != UT_DUP_ACK_THRESHOLD) {
+    return false;
+  }
+  ut_cc_on_loss(sock, false);
+  return true;
+}
+
+bool ut_ack_on_data(ut_socket_t *sock, bool in_order) {
+  if (sock->opts.ack_policy != UT_ACK_DELAYED || !in_order ||
+      ++sock->ack_pending >= 2) {
+    return true;
+  }
+  if (sock->ack_deadline == 0) {
+    sock->ack_deadline = ut_now_ms() + sock->opts.ack_delay;
+  }
+  return false;
+}
+
+bool ut_ack_timer_due(ut_socket_t *sock) {
+  return sock->ack_deadline != 0 && ut_now_ms() >= sock->ack_deadline;
+}
+
+void ut_ack_sent(ut_socket_t *sock) {
+  sock->ack_pending = 0;
+  sock->ack_deadline = 0;
+}
+
+uint32_t ut_recv_store(ut_socket_t *sock, uint32_t seq, const uint8_t *payload,
+                       uint32_t len) {
+  uint32_t last_read =
+      atomic_load_explicit(&sock->recv_win.last_read, memory_order_acquire);
+  // Published bytes belong to the reader, which may be copying them now.
+  uint32_t first =
+      atomic_load_explicit(&sock->recv_win.next_expect, memory_order_relaxed);
+  uint32_t limit = last_read + sock->opts.recv_buf;
+
+  // Drop whatever was already published or lies beyond the ring.
+  if (before(seq, first)) {
+    if (!after(seq + len, first)) {
+      return 0;
+    }
+    payload += first - seq;
+    len -= first - seq;
+    seq = first;
+  }
+  if (after(seq, limit)) {
+    return 0;
+  }
+  if (after(seq + len - 1, limit)) {
+    len = limit - seq + 1;
+  }
+
+  ring_copy_in(sock->received_buf, sock->recv_ring_size, seq, payload, len);
+  return len;
+}
+
+void ut_recv_publish(ut_socket_t *sock, uint32_t next_expect) {
+  atomic_store_explicit(&sock->recv_win.next_expect, next_expect,
+                        memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&sock->recv_waiting)) {
+    pthread_mutex_lock(&(sock->recv_lock));
+    pthread_cond_broadcast(&(sock->wait_cond));
+    pthread_mutex_unlock(&(sock->recv_lock));
+  }
+}
+
+uint16_t ut_recv_window(ut_socket_t *sock) {
+  return sock->opts.recv_buf -
+         (sock->recv_win.next_expect - sock->recv_win.last_read - 1);
+}
+
+uint16_t ut_hlen(ut_socket_t *sock) {
+  return sizeof(ut_tcp_header_t) + (sock->csum_enabled ? CSUM_EXT_LEN : 0);
+}
+
+uint8_t ut_csum_offer(ut_socket_t *sock) {
+  bool offer = sock->type == TCP_INITIATOR ? sock->csum_wanted
+                                           : sock->csum_enabled;
+  return offer ? CSUM_FLAG_MASK : 0;
+}
+
+void ut_csum_negotiate(ut_socket_t *sock, uint8_t flags) {
+  sock->csum_enabled = sock->csum_wanted && (flags & CSUM_FLAG_MASK);
+}
+
+uint16_t ut_mss(ut_socket_t *sock) {
+  return atomic_load_explicit(&sock->max_len, memory_order_relaxed) -
+         ut_hlen(sock);
+}
+
+uint32_t ut_rto_clamp(ut_socket_t *sock, uint32_t rto) {
+  if (rto < sock->opts.rto_min) {
+    return sock->opts.rto_min;
+  }
+  if (rto > sock->opts.rto_max) {
+    return sock->opts.rto_max;
+  }
+  return rto;
+}
@@ -0,0 +1,202 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+/*
+ * Tests for `ut_close` and the TIME_WAIT reaper.
+ *
+ * `begin_backend` is replaced by a stub that plays one of a few backends:
+ * one that takes the background handoff, one that finishes the close late
+ * without taking it, and one that exits at once without reporting the
+ * close. Each test checks how long `ut_close` takes and what state the
+ * connection is left in. The reaper test then sends FINs at the closed
+ * port, from the peer and from a stranger, and checks which get the final
+ * ACK.
+ *
+ * Usage: close_reaper
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "test_util.h"
+#include "ut_tcp.h"
+#include "ut_time.h"
+
+#define FIN_SEQ 1000
+#define PEER_FIN_SEQ 5000
+#define SLOW_FINISH (UT_HANDOFF_TIMEOUT + 200)  // ms
+#define LONG_LINGER 5000                       // ms
+
+typedef enum {
+  BACKEND_HANDOFF,  // Takes the background handoff, then finishes the close.
+  BACKEND_SLOW,     // Never takes the handoff; finishes SLOW_FINISH ms late.
+  BACKEND_EXIT,     // Exits at once without reporting the close.
+} backend_mode_t;
+
+static backend_mode_t mode;
+
+static void finish(ut_socket_t* sock) {
+  sock->send_fin_seq = FIN_SEQ;
+  sock->recv_fin_seq = PEER_FIN_SEQ;
+  ut_backend_finish(sock);
+}
+
+void* begin_backend(void* in) {
+  ut_socket_t* sock = in;
+
+  if (mode == BACKEND_EXIT) {
+    return NULL;
+  }
+  while (!atomic_load(&sock->dying)) {
+    usleep(1000);
+  }
+  if (mode == BACKEND_SLOW) {
+    usleep(SLOW_FINISH * 1000);
+    finish(sock);
+    return NULL;
+  }
+  // `dying` is set just before the handoff is requested.
+  do {
+    usleep(1000);
+    sock = ut_backend_handoff(sock);
+  } while (!sock->detached);
+  finish(sock);
+  return NULL;
+}
+
+static int udp_socket(struct sockaddr_in* addr) {
+  socklen_t len = sizeof(*addr);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  CHECK(fd >= 0, "socket");
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(bind(fd, (struct sockaddr*)addr, sizeof(*addr)) == 0, "bind");
+  getsockname(fd, (struct sockaddr*)addr, &len);
+  return fd;
+}
+
+/*
+ * Opens a socket to `peer`, closes it with the given linger and backend, and
+ * returns how long `ut_close` took. The socket's port is stored in `port`.
+ */
+static int64_t timed_close(backend_mode_t backend, int linger,
+                           const struct sockaddr_in* peer, uint16_t* port,
+                           ut_close_state_t* state) {
+  ut_socket_t* sock = aligned_alloc(UT_CACHELINE, sizeof(ut_socket_t));
+  int64_t start;
+
+  CHECK(sock != NULL, "out of memory");
+  mode = backend;
+  CHECK(ut_socket(sock, TCP_INITIATOR, ntohs(peer->sin_port), "127.0.0.1") ==
+            0,
+        "ut_socket");
+  ut_set_linger(sock, linger);
+  *port = sock->my_port;
+  start = ut_now_ms();
+  CHECK(ut_close(sock) == 0, "ut_close");
+  start = ut_now_ms() - start;
+  // After a handoff the application's struct is no longer used.
+  *state = backend == BACKEND_HANDOFF ? UT_TIME_WAIT : sock->close_state;
+  free(sock);
+  return start;
+}
+
+/*
+ * Sends a FIN from `fd` to the closed port.
+ */
+static void send_fin(int fd, uint16_t src, uint16_t port) {
+  struct sockaddr_in dst;
+  uint16_t hlen = sizeof(ut_tcp_header_t);
+  uint8_t* pkt = create_packet(src, port, PEER_FIN_SEQ, FIN_SEQ + 1, hlen,
+                               hlen, FIN_FLAG_MASK | ACK_FLAG_MASK, 0, NULL, 0);
+
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  dst.sin_port = htons(port);
+  CHECK(pkt != NULL, "out of memory");
+  sendto(fd, pkt, hlen, 0, (struct sockaddr*)&dst, sizeof(dst));
+  free(pkt);
+}
+
+/*
+ * Waits up to `timeout` ms for the final ACK on `fd`. Returns 1 if it came.
+ */
+static int got_final_ack(int fd, int timeout) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  uint8_t buf[UT_MAX_PACKET];
+  ut_tcp_header_host_t hdr;
+  ssize_t n;
+
+  if (poll(&pfd, 1, timeout) <= 0) {
+    return 0;
+  }
+  n = recv(fd, buf, sizeof(buf), 0);
+  CHECK(n >= (ssize_t)sizeof(ut_tcp_header_t), "short reply");
+  decode_header(buf, &hdr);
+  CHECK(hdr.flags == ACK_FLAG_MASK && hdr.seq_num == FIN_SEQ + 1 &&
+            hdr.ack_num == PEER_FIN_SEQ + 1,
+        "reply flags %x seq %u ack %u", hdr.flags, hdr.seq_num, hdr.ack_num);
+  return 1;
+}
+
+int main(void) {
+  struct sockaddr_in peer, stranger;
+  int peer_fd = udp_socket(&peer);
+  int stranger_fd = udp_socket(&stranger);
+  ut_close_state_t state;
+  uint16_t port;
+  int64_t took;
+
+  took = timed_close(BACKEND_EXIT, UT_LINGER_BACKGROUND, &peer, &port, &state);
+  CHECK(took < UT_HANDOFF_TIMEOUT, "background close of an exited backend "
+        "took %lld ms", (long long)took);
+  CHECK(state == UT_OPEN, "exited backend left state %d", state);
+
+  took = timed_close(BACKEND_EXIT, LONG_LINGER, &peer, &port, &state);
+  CHECK(took < 10 * UT_CLOSE_POLL, "lingering close of an exited backend "
+        "took %lld ms", (long long)took);
+
+  took = timed_close(BACKEND_SLOW, LONG_LINGER, &peer, &port, &state);
+  CHECK(took >= SLOW_FINISH && took < LONG_LINGER,
+        "lingering close took %lld ms", (long long)took);
+  CHECK(state == UT_TIME_WAIT, "lingering close left state %d", state);
+
+  took = timed_close(BACKEND_SLOW, UT_LINGER_BACKGROUND, &peer, &port, &state);
+  CHECK(took >= SLOW_FINISH && took < LONG_LINGER,
+        "background close without handoff took %lld ms", (long long)took);
+  CHECK(state == UT_TIME_WAIT, "background close left state %d", state);
+
+  took = timed_close(BACKEND_HANDOFF, UT_LINGER_BACKGROUND, &peer, &port,
+                     &state);
+  CHECK(took < UT_HANDOFF_TIMEOUT, "background close with handoff took %lld ms",
+        (long long)took);
+
+  // Wait for the handed-off backend to pass the port to the reaper.
+  usleep(100 * 1000);
+  send_fin(stranger_fd, ntohs(peer.sin_port), port);
+  CHECK(!got_final_ack(peer_fd, 200) && !got_final_ack(stranger_fd, 0),
+        "reaper answered a FIN from a stranger");
+  send_fin(peer_fd, ntohs(peer.sin_port), port);
+  CHECK(got_final_ack(peer_fd, 1000), "reaper did not answer the peer's FIN");
+
+  // Past TIME_WAIT the port is closed and nothing answers.
+  usleep((TIME_WAIT_TIMEOUT + 200) * 1000);
+  send_fin(peer_fd, ntohs(peer.sin_port), port);
+  CHECK(!got_final_ack(peer_fd, 200), "reaper answered after TIME_WAIT");
+
+  close(peer_fd);
+  close(stranger_fd);
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
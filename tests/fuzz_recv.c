@@ -0,0 +1,737 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+/*
+ * Stress and fuzz harness for the segment receive path.
+ *
+ * Builds crafted and random datagrams (malformed headers, corrupted
+ * checksums, flipped flags, duplicated, reordered and out-of-window
+ * segments, sequence numbers that wrap), with and without checksums
+ * required, and runs them through the same steps the backend takes
+ * for every received datagram: `validate_packets`, then `ut_recv_store` and
+ * `ut_recv_publish` for connection data, or `ut_stream_deliver` for stream
+ * data. Stream datagrams carry connection sequence numbers from the same
+ * window as connection data, which the receiver must ignore. A reader
+ * thread drains the socket concurrently, with `ut_read`, `ut_readv`,
+ * `ut_recv_zc` and `ut_stream_read`, and checks every byte against the
+ * pattern the sender used. A second pair of threads sends framed messages
+ * through the ring, out of order, to a reader blocked in `ut_recv_msg`.
+ * Also checks the sequence number helpers, checksum negotiation and
+ * `crc32c` against a reference, and reports how many datagrams per second
+ * the path handles.
+ *
+ * Runs without the network backend: `begin_backend` is stubbed out by
+ * backend_stub.c.
+ *
+ * Usage: fuzz_recv [datagrams] [seed]
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "test_util.h"
+#include "ut_stream.h"
+#include "ut_tcp.h"
+
+#define BATCH 32
+#define NUM_STREAMS 3
+#define MAX_PAYLOAD 1400
+#define START_SEQ 0xffff0000u  // Wraps after the first 64 KiB.
+#define READ_BUF 8192
+#define NUM_MSGS 4000
+#define MSG_MAX 3000
+#define CRC_MAX 2000
+
+typedef enum {
+  GOOD = 0,
+  BAD_IDENTIFIER,
+  BAD_PORT,
+  HLEN_OVER_PLEN,
+  HLEN_TOO_SHORT,
+  PLEN_MISMATCH,
+  TRUNCATED,
+  BAD_CHECKSUM,
+  SHORT_STREAM_EXT,
+  FLIP_FLAG,
+  NUM_KINDS,
+} mutation_t;
+
+typedef struct {
+  ut_socket_t* sock;
+  atomic_bool done;  // The sender has finished; drain what is left.
+
+  /* Sender thread. */
+  uint32_t next_expect;  // Connection: first byte not yet received in order.
+  uint32_t recv_max;     // Connection: one past the highest byte received.
+  uint8_t* present;      // Connection: bytes received beyond next_expect.
+  uint32_t stream_sent[NUM_STREAMS + 1];  // Highest stream offset accepted.
+  uint32_t stream_base[NUM_STREAMS + 1];  // Stream offset last known read.
+  uint64_t datagrams;
+  uint64_t valid;
+  uint64_t bad_checksums;
+
+  /* Reader thread. */
+  uint32_t read_seq;  // Connection: sequence number of the next byte read.
+  uint32_t stream_read[NUM_STREAMS + 1];  // Stream offset of the next read.
+  uint64_t bytes_read;
+  uint64_t reader_seed;
+} harness_t;
+
+// Each thread draws from its own generator.
+static _Thread_local uint64_t rng_state;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint32_t rng_below(uint32_t n) { return rng() % n; }
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The byte the sender put at a position of a stream (0 for the connection's
+ * own byte stream).
+ */
+static uint8_t pattern(uint16_t stream_id, uint32_t pos) {
+  uint32_t x = (pos ^ (stream_id * 0x9e3779b9u)) * 2654435761u;
+  return x >> 24;
+}
+
+/*
+ * Writes a datagram into `pkt` and returns its length. Payload starts at
+ * `pos` of the given stream; `mut` selects how it is broken. With
+ * `require_csum` every datagram carries a checksum, as after negotiation.
+ */
+static uint32_t build(uint8_t* pkt, uint16_t port, uint32_t seq,
+                      uint16_t stream_id, uint32_t pos, uint32_t len,
+                      mutation_t mut, bool require_csum) {
+  bool csum = require_csum || mut == BAD_CHECKSUM || mut == FLIP_FLAG ||
+              rng_below(4) == 0;
+  uint8_t flags = ACK_FLAG_MASK | (csum ? CSUM_FLAG_MASK : 0) |
+                  (stream_id ? STREAM_FLAG_MASK : 0);
+  uint16_t hlen = sizeof(ut_tcp_header_t) + (csum ? CSUM_EXT_LEN : 0) +
+                  (stream_id ? STREAM_EXT_LEN : 0);
+  uint32_t plen = hlen + len;
+
+  if (mut == SHORT_STREAM_EXT) {
+    flags |= STREAM_FLAG_MASK;
+    hlen = stream_ext_offset(flags) + rng_below(STREAM_EXT_LEN);
+    plen = hlen + len;
+  }
+  set_header((ut_tcp_header_t*)pkt, 4000, port, seq, 0, hlen, plen, flags,
+             MAX_NETWORK_BUFFER);
+  memset(pkt + sizeof(ut_tcp_header_t), 0, hlen - sizeof(ut_tcp_header_t));
+  if (stream_id && mut != SHORT_STREAM_EXT) {
+    set_stream(pkt, stream_id, pos);
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    pkt[hlen + i] = pattern(stream_id, pos + i);
+  }
+  if (csum) {
+    set_checksum(pkt);
+  }
+
+  switch (mut) {
+    case BAD_IDENTIFIER:
+      pkt[rng_below(4)] ^= 1 << rng_below(8);
+      break;
+    case BAD_PORT:
+      set_dst((ut_tcp_header_t*)pkt, port + 1 + rng_below(100));
+      break;
+    case HLEN_OVER_PLEN:
+      set_hlen((ut_tcp_header_t*)pkt, plen + 1 + rng_below(100));
+      break;
+    case HLEN_TOO_SHORT:
+      set_hlen((ut_tcp_header_t*)pkt, rng_below(sizeof(ut_tcp_header_t)));
+      break;
+    case PLEN_MISMATCH:
+      set_plen((ut_tcp_header_t*)pkt, plen + 1 + rng_below(100));
+      break;
+    case TRUNCATED:
+      return rng_below(sizeof(ut_tcp_header_t));
+    case BAD_CHECKSUM:
+      // CRC32C catches every single-bit error.
+      pkt[sizeof(ut_tcp_header_t) + rng_below(plen - sizeof(ut_tcp_header_t))] ^=
+          1 << rng_below(8);
+      break;
+    case FLIP_FLAG: {
+      // The CRC covers the flags. Clearing CSUM_FLAG_MASK is only caught
+      // once checksums are required; without that it is a valid datagram.
+      uint8_t bit = 1 << rng_below(8);
+      if (bit == CSUM_FLAG_MASK && !require_csum) {
+        bit = SYN_FLAG_MASK;
+      }
+      set_flags((ut_tcp_header_t*)pkt, flags ^ bit);
+      break;
+    }
+    default:
+      break;
+  }
+  return plen;
+}
+
+/*
+ * Checks if `validate_packets` should count a datagram broken with `mut` in
+ * `csum_drops`: if it reaches the checksum, which it then fails.
+ */
+static bool counts_as_csum_drop(uint8_t* pkt, mutation_t mut) {
+  uint8_t flags = get_flags((ut_tcp_header_t*)pkt);
+  uint16_t hlen = get_hlen((ut_tcp_header_t*)pkt);
+
+  if (mut == BAD_CHECKSUM) {
+    return true;
+  }
+  if (mut != FLIP_FLAG) {
+    return false;
+  }
+  // Setting an extension flag may leave `hlen` too short for it.
+  return (!(flags & STREAM_FLAG_MASK) ||
+          hlen >= stream_ext_offset(flags) + STREAM_EXT_LEN) &&
+         (!(flags & COOKIE_FLAG_MASK) ||
+          hlen >= cookie_ext_offset(flags) + COOKIE_EXT_LEN);
+}
+
+/*
+ * Picks where the next connection segment starts: mostly at or just past
+ * the first missing byte, sometimes duplicated data already received, and
+ * sometimes beyond the receive window.
+ */
+static uint32_t pick_seq(harness_t* h) {
+  switch (rng_below(8)) {
+    case 0:
+      return h->next_expect - rng_below(2 * MAX_PAYLOAD);
+    case 1:
+      return h->next_expect + MAX_NETWORK_BUFFER - rng_below(MAX_PAYLOAD);
+    case 2:
+    case 3:
+      return h->next_expect;
+    default:
+      return h->next_expect + rng_below(8 * MAX_PAYLOAD);
+  }
+}
+
+/*
+ * What the backend does with a connection payload: store it, track the
+ * holes, and publish whatever became contiguous.
+ *
+ * The reader may free ring space while the payload is stored, so the window
+ * is only known to lie between two snapshots of `last_read`. Bytes inside
+ * the older window must have been stored; only those are marked present.
+ * Any others are simply sent again later.
+ */
+static void store_segment(harness_t* h, ut_socket_t* sock, uint32_t seq,
+                          const uint8_t* payload, uint32_t len) {
+  uint32_t buf = sock->opts.recv_buf;
+  uint32_t lr0 = atomic_load(&sock->recv_win.last_read);
+  uint32_t stored = ut_recv_store(sock, seq, payload, len);
+  uint32_t lr1 = atomic_load(&sock->recv_win.last_read);
+  uint32_t start = before(seq, h->next_expect) ? h->next_expect : seq;
+  uint32_t first = before(seq, lr0 + 1) ? lr0 + 1 : seq;
+  uint32_t end = seq + len;
+  uint32_t sure;
+
+  if (after(end, lr0 + 1 + buf)) {
+    end = lr0 + 1 + buf;
+  }
+  sure = after(end, start) ? end - start : 0;
+  CHECK(stored <= len, "stored %u of a %u byte payload", stored, len);
+  CHECK(stored >= sure, "in-window payload at %u+%u: stored %u of %u", seq,
+        len, stored, sure);
+  CHECK(stored == 0 || !after(first + stored, lr1 + 1 + buf),
+        "stored past the window: %u+%u, last_read %u", seq, stored, lr1);
+
+  for (uint32_t i = 0; i < sure; i++) {
+    h->present[(start + i) & (sock->recv_ring_size - 1)] = 1;
+  }
+  if (sure > 0 && after(end, h->recv_max)) {
+    h->recv_max = end;
+  }
+  while (before(h->next_expect, h->recv_max) &&
+         h->present[h->next_expect & (sock->recv_ring_size - 1)]) {
+    h->present[h->next_expect & (sock->recv_ring_size - 1)] = 0;
+    h->next_expect++;
+  }
+  ut_recv_publish(sock, h->next_expect);
+  CHECK(ut_recv_window(sock) <= buf, "window %u over %u",
+        ut_recv_window(sock), buf);
+}
+
+/*
+ * What the backend does with a valid stream datagram: deliver it under
+ * `recv_lock` and wake the readers. The stream's read offset is taken from
+ * `ut_stream_ack_info` under the same lock, so whether the payload fits is
+ * known exactly.
+ */
+static void deliver_stream(harness_t* h, ut_socket_t* sock, uint8_t* pkt,
+                           const ut_tcp_header_host_t* hdr) {
+  uint32_t len = hdr->plen - hdr->hlen;
+  uint32_t off, ack, next_read = 0, want, got;
+  uint16_t id, window;
+
+  get_stream(pkt, &id, &off);
+  pthread_mutex_lock(&(sock->recv_lock));
+  if (ut_stream_ack_info(sock, id, &ack, &window) == 0) {
+    next_read = ack - (sock->opts.recv_buf - window);
+  }
+  want = id >= 1 && id <= UT_MAX_STREAMS &&
+                 !after(off + len, next_read + sock->opts.recv_buf)
+             ? len
+             : 0;
+  got = ut_stream_deliver(sock, id, off, pkt + hdr->hlen, len);
+  pthread_cond_broadcast(&(sock->wait_cond));
+  pthread_mutex_unlock(&(sock->recv_lock));
+
+  CHECK(got == want, "stream %u at %u+%u: delivered %u, expected %u", id, off,
+        len, got, want);
+  CHECK(atomic_load(&sock->recv_win.next_expect) == h->next_expect,
+        "stream datagram with seq %u moved the connection", hdr->seq_num);
+  if (id <= NUM_STREAMS) {
+    h->stream_base[id] = next_read;
+    if (got > 0 && after(off + len, h->stream_sent[id])) {
+      h->stream_sent[id] = off + len;
+    }
+  }
+}
+
+/*
+ * Picks where the next datagram of a stream starts: mostly within what the
+ * receiver can hold, sometimes just beyond it.
+ */
+static uint32_t pick_stream_off(harness_t* h, ut_socket_t* sock, uint16_t id,
+                                uint32_t len) {
+  uint32_t base = h->stream_base[id];
+  uint32_t range = h->stream_sent[id] - base + MAX_PAYLOAD;
+
+  if (rng_below(16) == 0) {
+    return base + sock->opts.recv_buf - len + 1 + rng_below(MAX_PAYLOAD);
+  }
+  if (range > sock->opts.recv_buf - len) {
+    range = sock->opts.recv_buf - len;
+  }
+  return base + rng_below(range);
+}
+
+static void check_read(harness_t* h, const uint8_t* buf, int n) {
+  for (int i = 0; i < n; i++) {
+    CHECK(buf[i] == pattern(0, h->read_seq + i),
+          "byte at seq %u is %u, expected %u", h->read_seq + i, buf[i],
+          pattern(0, h->read_seq + i));
+  }
+}
+
+/*
+ * Drains whatever the application can read and checks it against the
+ * pattern, rotating between copying, scattering and zero-copy reads.
+ * Returns the number of bytes read.
+ */
+static uint64_t drain(harness_t* h, ut_socket_t* sock) {
+  uint8_t buf[READ_BUF];
+  struct iovec spans[2], iov[3];
+  uint64_t total;
+  size_t cut1, cut2;
+  int n;
+
+  switch (rng_below(3)) {
+    case 0:
+      n = ut_read(sock, buf, 1 + rng_below(READ_BUF), NO_WAIT);
+      CHECK(n >= 0, "ut_read failed");
+      check_read(h, buf, n);
+      break;
+    case 1:
+      // Three fragments of random sizes, any of them possibly empty.
+      cut1 = rng_below(READ_BUF);
+      cut2 = cut1 + rng_below(READ_BUF - cut1);
+      iov[0].iov_base = buf;
+      iov[0].iov_len = cut1;
+      iov[1].iov_base = buf + cut1;
+      iov[1].iov_len = cut2 - cut1;
+      iov[2].iov_base = buf + cut2;
+      iov[2].iov_len = READ_BUF - cut2;
+      n = ut_readv(sock, iov, 3, NO_WAIT);
+      CHECK(n >= 0, "ut_readv failed");
+      check_read(h, buf, n);
+      break;
+    default:
+      n = ut_recv_zc(sock, spans, NO_WAIT);
+      CHECK(n >= 0, "ut_recv_zc failed");
+      CHECK((int)(spans[0].iov_len + spans[1].iov_len) == n,
+            "spans do not add up");
+      for (int i = 0; i < n; i++) {
+        uint8_t b = (size_t)i < spans[0].iov_len
+                        ? ((uint8_t*)spans[0].iov_base)[i]
+                        : ((uint8_t*)spans[1].iov_base)[i - spans[0].iov_len];
+        CHECK(b == pattern(0, h->read_seq + i), "lent byte at seq %u is wrong",
+              h->read_seq + i);
+      }
+      CHECK(ut_recv_release(sock, n) == 0, "release failed");
+  }
+  h->read_seq += n;
+  total = n;
+
+  for (uint16_t id = 1; id <= NUM_STREAMS; id++) {
+    n = ut_stream_read(sock, id, buf, 1 + rng_below(READ_BUF), NO_WAIT);
+    CHECK(n >= 0, "ut_stream_read failed");
+    for (int i = 0; i < n; i++) {
+      CHECK(buf[i] == pattern(id, h->stream_read[id] + i),
+            "stream %u byte at %u is wrong", id, h->stream_read[id] + i);
+    }
+    h->stream_read[id] += n;
+    total += n;
+  }
+  h->bytes_read += total;
+  return total;
+}
+
+/*
+ * The reader thread: drains the socket until the sender is done, then
+ * reads whatever is left.
+ */
+static void* reader(void* arg) {
+  harness_t* h = arg;
+
+  rng_state = h->reader_seed;
+  while (!atomic_load(&h->done)) {
+    if (drain(h, h->sock) == 0) {
+      sched_yield();
+    }
+  }
+  while (drain(h, h->sock) > 0) {
+  }
+  return NULL;
+}
+
+/*
+ * Checks the header `validate_packets` decoded, possibly with SSSE3, against
+ * the scalar `decode_header`.
+ */
+static void check_decode(const uint8_t* pkt, const ut_tcp_header_host_t* got) {
+  ut_tcp_header_host_t want;
+
+  decode_header(pkt, &want);
+  CHECK(got->identifier == want.identifier &&
+            got->source_port == want.source_port &&
+            got->destination_port == want.destination_port &&
+            got->seq_num == want.seq_num && got->ack_num == want.ack_num &&
+            got->hlen == want.hlen && got->plen == want.plen &&
+            got->flags == want.flags &&
+            got->advertised_window == want.advertised_window,
+        "batch decode of seq %u differs from decode_header", want.seq_num);
+}
+
+/*
+ * Checks `before`, `after` and `between` on random pairs, including pairs
+ * that straddle the wrap of the sequence space.
+ */
+static void check_seq_helpers(uint64_t rounds) {
+  for (uint64_t i = 0; i < rounds; i++) {
+    uint32_t a = rng_below(8) == 0 ? UINT32_MAX - rng_below(1 << 16) : rng();
+    uint32_t d = 1 + rng_below(INT32_MAX);
+    uint32_t b = a + d;
+    uint32_t mid = a + rng_below(d + 1);
+
+    CHECK(before(a, b) && after(b, a), "%u should precede %u", a, b);
+    CHECK(!before(a, a) && !after(a, a), "%u compared with itself", a);
+    CHECK(before(a, b) != before(b, a), "order of %u and %u not antisymmetric",
+          a, b);
+    CHECK(between(mid, a, b), "%u should be in [%u, %u]", mid, a, b);
+    CHECK(between(a, a, b) && between(b, a, b), "bounds of [%u, %u]", a, b);
+    CHECK(!between(b + 1, a, b), "%u should be outside [%u, %u]", b + 1, a, b);
+  }
+}
+
+/*
+ * Runs the checksum handshake for every combination of preferences: the
+ * initiator's SYN, then the listener's SYN-ACK.
+ */
+static void check_csum_negotiation(void) {
+  for (int wants = 0; wants < 4; wants++) {
+    ut_socket_t initiator = {.type = TCP_INITIATOR, .csum_wanted = wants & 1};
+    ut_socket_t listener = {.type = TCP_LISTENER, .csum_wanted = wants >> 1};
+    bool both = wants == 3;
+
+    ut_csum_negotiate(&listener, ut_csum_offer(&initiator));
+    ut_csum_negotiate(&initiator, ut_csum_offer(&listener));
+    CHECK(initiator.csum_enabled == both && listener.csum_enabled == both,
+          "initiator wants %d, listener wants %d: enabled %d and %d",
+          wants & 1, wants >> 1, initiator.csum_enabled,
+          listener.csum_enabled);
+  }
+}
+
+/*
+ * Checks `crc32c` against a bit-at-a-time CRC for every length up to
+ * CRC_MAX, at every alignment and split across two calls, and reports its
+ * throughput on a full-sized payload.
+ */
+static void check_crc32c(void) {
+  static uint8_t buf[CRC_MAX + 8];
+  double start;
+  uint32_t crc = 0;
+  int rounds = 200000;
+
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    buf[i] = rng();
+  }
+  for (uint32_t len = 0; len <= CRC_MAX; len++) {
+    const uint8_t* data = buf + len % 8;
+    uint32_t expect = 0xffffffff;
+    uint32_t split = rng_below(len + 1);
+
+    for (uint32_t i = 0; i < len; i++) {
+      expect ^= data[i];
+      for (int bit = 0; bit < 8; bit++) {
+        expect = (expect >> 1) ^ (0x82F63B78 & -(expect & 1));
+      }
+    }
+    expect = ~expect;
+    CHECK(crc32c(0, data, len) == expect, "crc32c of %u bytes", len);
+    CHECK(crc32c(crc32c(0, data, split), data + split, len - split) == expect,
+          "crc32c of %u bytes split at %u", len, split);
+  }
+
+  start = now_sec();
+  for (int i = 0; i < rounds; i++) {
+    crc = crc32c(crc, buf, MAX_PAYLOAD);
+  }
+  printf("crc32c: %.2f GB/s on %d-byte payloads (%08x)\n",
+         rounds * (double)MAX_PAYLOAD / (now_sec() - start) / 1e9, MAX_PAYLOAD,
+         crc);
+}
+
+static uint32_t msg_len(uint32_t msg) {
+  return 1 + (msg * 2654435761u >> 8) % MSG_MAX;
+}
+
+/*
+ * Reads NUM_MSGS messages, blocking in `ut_recv_msg`, and checks each.
+ */
+static void* msg_reader(void* arg) {
+  static uint8_t buf[MSG_MAX];
+  ut_socket_t* sock = arg;
+
+  for (uint32_t msg = 0; msg < NUM_MSGS; msg++) {
+    int n = ut_recv_msg(sock, buf, sizeof(buf), NO_FLAG);
+
+    CHECK(n == (int)msg_len(msg), "message %u is %d bytes, expected %u", msg,
+          n, msg_len(msg));
+    for (int i = 0; i < n; i++) {
+      CHECK(buf[i] == pattern(msg, i), "byte %d of message %u is wrong", i,
+            msg);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Sends framed messages through the receive ring in reordered, duplicated
+ * segments of random size while another thread reads them with
+ * `ut_recv_msg`.
+ */
+static void check_msgs(void) {
+  static harness_t h;
+  ut_socket_t sock;
+  pthread_t thread;
+  uint8_t* framed;
+  uint32_t total = 0, pos = 0;
+
+  for (uint32_t msg = 0; msg < NUM_MSGS; msg++) {
+    total += UT_MSG_HDR_LEN + msg_len(msg);
+  }
+  framed = malloc(total);
+  CHECK(framed != NULL, "out of memory");
+  for (uint32_t msg = 0; msg < NUM_MSGS; msg++) {
+    uint32_t prefix = htonl(msg_len(msg));
+    memcpy(framed + pos, &prefix, UT_MSG_HDR_LEN);
+    pos += UT_MSG_HDR_LEN;
+    for (uint32_t i = 0; i < msg_len(msg); i++) {
+      framed[pos++] = pattern(msg, i);
+    }
+  }
+
+  CHECK(ut_socket(&sock, TCP_LISTENER, 0, NULL) == 0, "ut_socket");
+  pthread_join(sock.thread_id, NULL);
+  h.present = calloc(sock.recv_ring_size, 1);
+  CHECK(h.present != NULL, "out of memory");
+  h.next_expect = START_SEQ;
+  h.recv_max = START_SEQ;
+  atomic_store(&sock.recv_win.last_read, START_SEQ - 1);
+  atomic_store(&sock.recv_win.next_expect, START_SEQ);
+  CHECK(pthread_create(&thread, NULL, msg_reader, &sock) == 0,
+        "pthread_create");
+
+  while (h.next_expect - START_SEQ < total) {
+    uint32_t seq = pick_seq(&h);
+    uint32_t len = 1 + rng_below(MAX_PAYLOAD);
+    uint32_t next = h.next_expect;
+
+    if (before(seq, START_SEQ)) {
+      seq = START_SEQ;
+    }
+    if (seq - START_SEQ >= total) {
+      continue;
+    }
+    if (len > total - (seq - START_SEQ)) {
+      len = total - (seq - START_SEQ);
+    }
+    store_segment(&h, &sock, seq, framed + (seq - START_SEQ), len);
+    if (h.next_expect == next) {
+      sched_yield();
+    }
+  }
+  pthread_join(thread, NULL);
+  CHECK(ut_recv_msg(&sock, framed, total, NO_WAIT) == 0,
+        "data left after the last message");
+
+  free(h.present);
+  free(framed);
+  ut_free_state(&sock);
+  close(sock.socket);
+}
+
+int main(int argc, char** argv) {
+  uint64_t total = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : (uint64_t)time(NULL);
+  static uint8_t storage[BATCH][MAX_PAYLOAD + 64];
+  uint8_t* pkts[BATCH];
+  uint32_t lens[BATCH];
+  uint8_t expect_valid[BATCH];
+  ut_tcp_header_host_t hdrs[BATCH];
+  uint8_t valid[BATCH];
+  ut_socket_t sock;
+  static harness_t h;
+  pthread_t thread;
+  uint32_t ack;
+  uint16_t window;
+  double start, elapsed = 0, validate_elapsed;
+  bool require_csum = false;
+
+  rng_state = seed ? seed : 1;
+  printf("fuzz_recv: %llu datagrams, seed %llu\n", (unsigned long long)total,
+         (unsigned long long)seed);
+
+  if (ut_socket(&sock, TCP_LISTENER, 0, NULL) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  pthread_join(sock.thread_id, NULL);
+
+  h.sock = &sock;
+  h.reader_seed = rng_state + 1;
+  h.present = calloc(sock.recv_ring_size, 1);
+  if (h.present == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  h.next_expect = START_SEQ;
+  h.recv_max = START_SEQ;
+  h.read_seq = START_SEQ;
+  atomic_store(&sock.recv_win.last_read, START_SEQ - 1);
+  atomic_store(&sock.recv_win.next_expect, START_SEQ);
+  for (int i = 0; i < BATCH; i++) {
+    pkts[i] = storage[i];
+  }
+
+  check_seq_helpers(total);
+  check_csum_negotiation();
+  check_crc32c();
+  check_msgs();
+
+  CHECK(pthread_create(&thread, NULL, reader, &h) == 0, "pthread_create");
+
+  while (h.datagrams < total) {
+    require_csum = rng_below(2) == 0;
+    for (int i = 0; i < BATCH; i++) {
+      mutation_t mut = rng_below(4) == 0 ? 1 + rng_below(NUM_KINDS - 1) : GOOD;
+      uint32_t len = 1 + rng_below(MAX_PAYLOAD);
+      uint16_t id = rng_below(4) == 0 ? 1 + rng_below(NUM_STREAMS) : 0;
+      // Stream datagrams carry a connection sequence number too.
+      uint32_t seq = pick_seq(&h);
+      uint32_t pos = seq;
+
+      if (id != 0 && rng_below(32) == 0) {
+        // Out of range: rejected, and no stream state is created.
+        id = UT_MAX_STREAMS + 1;
+        pos = 0;
+      } else if (id != 0) {
+        pos = pick_stream_off(&h, &sock, id, len);
+      }
+      lens[i] = build(pkts[i], sock.my_port, seq, id, pos, len, mut,
+                      require_csum);
+      expect_valid[i] = mut == GOOD;
+      h.bad_checksums += counts_as_csum_drop(pkts[i], mut);
+    }
+
+    // Only the receive side is timed, not building the datagrams.
+    start = now_sec();
+    validate_packets(pkts, lens, BATCH, sock.my_port, require_csum, hdrs,
+                     valid, &sock.csum_drops);
+    CHECK(sock.csum_drops == h.bad_checksums, "csum_drops %llu, expected %llu",
+          (unsigned long long)sock.csum_drops,
+          (unsigned long long)h.bad_checksums);
+    for (int i = 0; i < BATCH; i++) {
+      CHECK(valid[i] == expect_valid[i], "datagram %llu: valid %u, expected %u",
+            (unsigned long long)(h.datagrams + i), valid[i], expect_valid[i]);
+      if (!valid[i]) {
+        continue;
+      }
+      check_decode(pkts[i], &hdrs[i]);
+      h.valid++;
+      if (hdrs[i].flags & STREAM_FLAG_MASK) {
+        deliver_stream(&h, &sock, pkts[i], &hdrs[i]);
+      } else {
+        store_segment(&h, &sock, hdrs[i].seq_num, pkts[i] + hdrs[i].hlen,
+                      hdrs[i].plen - hdrs[i].hlen);
+      }
+    }
+    elapsed += now_sec() - start;
+    h.datagrams += BATCH;
+  }
+  atomic_store(&h.done, true);
+  pthread_join(thread, NULL);
+  CHECK(h.read_seq == h.next_expect, "read up to %u of %u", h.read_seq,
+        h.next_expect);
+  for (uint16_t id = 1; id <= NUM_STREAMS; id++) {
+    CHECK(ut_stream_ack_info(&sock, id, &ack, &window) < 0 ||
+              h.stream_read[id] == ack,
+          "stream %u read up to %u of %u", id, h.stream_read[id], ack);
+  }
+  CHECK(ut_stream_ack_info(&sock, UT_MAX_STREAMS + 1, &ack, &window) < 0,
+        "state created for an out-of-range stream");
+
+  // The header checks alone, on the last batch.
+  start = now_sec();
+  for (uint64_t n = 0; n < total; n += BATCH) {
+    validate_packets(pkts, lens, BATCH, sock.my_port, require_csum, hdrs,
+                     valid, NULL);
+  }
+  validate_elapsed = now_sec() - start;
+
+  printf("%llu datagrams, %llu valid, %llu bytes read in order\n",
+         (unsigned long long)h.datagrams, (unsigned long long)h.valid,
+         (unsigned long long)h.bytes_read);
+  printf("receive path: %.0f datagrams/s\n", h.datagrams / elapsed);
+  printf("validate_packets: %.0f datagrams/s\n", total / validate_elapsed);
+  if (total >= 100000) {
+    CHECK(!before(h.read_seq, START_SEQ + 65536), "sequence numbers never wrapped");
+  }
+
+  free(h.present);
+  ut_free_state(&sock);
+  close(sock.socket);
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
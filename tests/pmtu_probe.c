@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+/*
+ * Tests for path MTU discovery over loopback.
+ *
+ * Two sockets probe each other with `ut_pmtu_tick` and answer with
+ * `ut_pmtu_on_packet`, the way the backend would; `begin_backend` is
+ * stubbed out by backend_stub.c. Probes larger than a simulated path MTU are
+ * dropped before they reach the peer. Checks that probing is off by
+ * default, that a jumbo path is found with the first probe, that a narrower
+ * path is found by the search, that the socket's DF setting is left alone
+ * for data, and that falling back returns to `opts.mtu`.
+ *
+ * Usage: pmtu_probe
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "test_util.h"
+#include "ut_pmtu.h"
+#include "ut_tcp.h"
+
+#define NARROW_PATH 4000
+#define WAIT 20          // ms to wait for a probe or its ACK.
+#define MAX_ROUNDS 500
+
+/*
+ * Receives one datagram within WAIT ms. Returns its length, or -1.
+ */
+static ssize_t receive(int fd, uint8_t* buf) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+  if (poll(&pfd, 1, WAIT) <= 0) {
+    return -1;
+  }
+  return recv(fd, buf, UT_MAX_PACKET, 0);
+}
+
+/*
+ * Lets `a` send its next probe and delivers it to `b` if it fits the path,
+ * then delivers `b`'s answer. Returns the size of the probe sent, or 0.
+ */
+static ssize_t probe_round(ut_socket_t* a, ut_socket_t* b, uint32_t path_mtu) {
+  static uint8_t buf[UT_MAX_PACKET];
+  ssize_t n;
+
+  ut_pmtu_tick(a);
+  n = receive(b->socket, buf);
+  if (n < 0) {
+    return 0;
+  }
+  if (n + UT_IP_UDP_OVERHEAD <= path_mtu) {
+    CHECK(ut_pmtu_on_packet(b, buf) == 1, "probe not recognized");
+    CHECK(receive(a->socket, buf) > 0, "probe of %zd bytes not answered", n);
+    CHECK(ut_pmtu_on_packet(a, buf) == 1, "probe ACK not recognized");
+  }
+  return n;
+}
+
+static int df_mode(ut_socket_t* sock) {
+  int mode;
+  socklen_t len = sizeof(mode);
+
+  CHECK(getsockopt(sock->socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, &len) ==
+            0,
+        "getsockopt");
+  return mode;
+}
+
+static uint32_t max_len(ut_socket_t* sock) {
+  return atomic_load(&sock->max_len);
+}
+
+/*
+ * Opens a connected pair of sockets on loopback with the given probe limit.
+ */
+static void open_pair(ut_socket_t* a, ut_socket_t* b, uint32_t max_mtu) {
+  ut_socket_opts_t opts;
+
+  ut_socket_opts_init(&opts);
+  opts.rto_min = 1;
+  if (max_mtu != 0) {
+    opts.max_mtu = max_mtu;
+  }
+  CHECK(ut_socket_ex(b, TCP_LISTENER, 0, NULL, &opts) == 0, "listener");
+  CHECK(ut_socket_ex(a, TCP_INITIATOR, b->my_port, "127.0.0.1", &opts) == 0,
+        "initiator");
+  pthread_join(a->thread_id, NULL);
+  pthread_join(b->thread_id, NULL);
+  b->conn.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  b->conn.sin_port = htons(a->my_port);
+  a->srtt = 5;
+}
+
+static void close_pair(ut_socket_t* a, ut_socket_t* b) {
+  ut_free_state(a);
+  ut_free_state(b);
+  close(a->socket);
+  close(b->socket);
+}
+
+int main(void) {
+  ut_socket_t a, b;
+  uint32_t mtu;
+  int mode;
+
+  // Off by default: nothing is sent and DF is left to the kernel.
+  open_pair(&a, &b, 0);
+  mode = df_mode(&a);
+  CHECK(a.opts.max_mtu == a.opts.mtu, "probing on by default, max_mtu %u",
+        a.opts.max_mtu);
+  for (int i = 0; i < 3; i++) {
+    CHECK(probe_round(&a, &b, UT_MTU_MAX) == 0, "probe sent by default");
+  }
+  CHECK(max_len(&a) == a.opts.mtu - UT_IP_UDP_OVERHEAD, "max_len changed");
+  close_pair(&a, &b);
+
+  // A jumbo path is confirmed by the first probe.
+  open_pair(&a, &b, UT_MTU_MAX);
+  CHECK(probe_round(&a, &b, UT_MTU_MAX) == UT_MTU_MAX - UT_IP_UDP_OVERHEAD,
+        "first probe was not for max_mtu");
+  CHECK(max_len(&a) == UT_MTU_MAX - UT_IP_UDP_OVERHEAD, "max_len %u",
+        max_len(&a));
+  CHECK(df_mode(&a) == mode, "DF mode %d left on the socket, was %d",
+        df_mode(&a), mode);
+
+  ut_pmtu_fall_back(&a);
+  CHECK(max_len(&a) == a.opts.mtu - UT_IP_UDP_OVERHEAD,
+        "fall back left max_len at %u", max_len(&a));
+  CHECK(probe_round(&a, &b, UT_MTU_MAX) == 0, "probed right after fall back");
+  close_pair(&a, &b);
+
+  // A narrower path is found by the search; lost probes narrow it.
+  open_pair(&a, &b, UT_MTU_MAX);
+  for (int i = 0; i < MAX_ROUNDS && a.pmtu_hi - a.pmtu_lo > PMTU_GRANULARITY;
+       i++) {
+    probe_round(&a, &b, NARROW_PATH);
+  }
+  mtu = max_len(&a) + UT_IP_UDP_OVERHEAD;
+  CHECK(mtu <= NARROW_PATH && mtu + PMTU_GRANULARITY > NARROW_PATH,
+        "search settled on %u for a path of %u (bounds %u..%u)", mtu,
+        NARROW_PATH, a.pmtu_lo, a.pmtu_hi);
+  CHECK(df_mode(&a) == mode, "DF mode %d left on the socket, was %d",
+        df_mode(&a), mode);
+  close_pair(&a, &b);
+
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
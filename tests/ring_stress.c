@@ -0,0 +1,413 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+/*
+ * Multi-threaded stress test for the rings shared by the application and
+ * the backend.
+ *
+ * Application threads and a thread playing the backend run at the same
+ * time on one socket:
+ *  - several writers call `ut_write` and `ut_writev` while the backend
+ *    drains the send ring with `ut_send_fetch`/`ut_send_release`;
+ *  - the backend fills the receive ring with `ut_recv_store` and
+ *    `ut_recv_publish` while a reader calls `ut_read`, then several readers
+ *    call `ut_recv_msg`;
+ *  - several writers call `ut_stream_write` on one stream while the backend
+ *    sends it with `ut_stream_next` and acknowledges it;
+ *  - a `ut_writev` longer than INT_MAX in total is refused untouched.
+ * Every record carries its writer and index, so torn, lost, duplicated or
+ * reordered data is caught. Build with -fsanitize=thread to have TSan check
+ * the memory ordering as well.
+ *
+ * Runs without the network backend: `begin_backend` is stubbed out by
+ * backend_stub.c.
+ *
+ * Usage: ring_stress [records per writer] [seed]
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "backend.h"
+#include "test_util.h"
+#include "ut_stream.h"
+#include "ut_tcp.h"
+
+#define WRITERS 3
+#define READERS 3
+#define MAX_RECORD 3000
+#define REC_HDR 9  // Length, writer, index.
+
+/*
+ * Reassembles records from a byte stream fed in arbitrary pieces and checks
+ * each one as it completes.
+ */
+typedef struct {
+  uint8_t rec[MAX_RECORD];
+  uint32_t have;
+  uint32_t next[WRITERS];  // Index of the next record expected per writer.
+  uint64_t records;
+} parser_t;
+
+static ut_socket_t* sock;
+static uint32_t per_writer;
+static uint64_t seed;
+static _Atomic int done;
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint8_t body_byte(uint32_t writer, uint32_t index, uint32_t i) {
+  return mix(((uint64_t)writer << 48) ^ ((uint64_t)index << 20) ^ i) >> 56;
+}
+
+static uint32_t record_len(uint32_t writer, uint32_t index) {
+  return REC_HDR + mix(seed ^ ((uint64_t)writer << 32) ^ index) %
+                       (MAX_RECORD - REC_HDR);
+}
+
+/*
+ * Builds record `index` of `writer`: its total length and writer, its
+ * index, then a body derived from both.
+ */
+static uint32_t build_record(uint8_t* rec, uint32_t writer, uint32_t index) {
+  uint32_t len = record_len(writer, index);
+  uint32_t be;
+
+  be = htonl(len);
+  memcpy(rec, &be, 4);
+  rec[4] = writer;
+  be = htonl(index);
+  memcpy(rec + 5, &be, 4);
+  for (uint32_t i = REC_HDR; i < len; i++) {
+    rec[i] = body_byte(writer, index, i);
+  }
+  return len;
+}
+
+/*
+ * Checks a whole record. Without `seen`, records of each writer must come
+ * in index order, tracked in `next`. With it, each record may come once, in
+ * any order.
+ */
+static void check_record(const uint8_t* rec, uint32_t len, uint32_t* next,
+                         uint8_t* seen) {
+  uint32_t writer = rec[4];
+  uint32_t index, want;
+
+  memcpy(&index, rec + 5, 4);
+  index = ntohl(index);
+  CHECK(writer < WRITERS && index < per_writer, "record header %u/%u", writer,
+        index);
+  want = record_len(writer, index);
+  CHECK(len == want, "record %u/%u is %u bytes, expected %u", writer, index,
+        len, want);
+  for (uint32_t i = REC_HDR; i < len; i++) {
+    CHECK(rec[i] == body_byte(writer, index, i), "record %u/%u torn at %u",
+          writer, index, i);
+  }
+  if (seen == NULL) {
+    CHECK(index == next[writer], "writer %u: record %u, expected %u", writer,
+          index, next[writer]);
+    next[writer]++;
+  } else {
+    CHECK(!seen[writer * per_writer + index], "record %u/%u read twice",
+          writer, index);
+    seen[writer * per_writer + index] = 1;
+  }
+}
+
+static void parse(parser_t* p, const uint8_t* buf, uint32_t len) {
+  while (len > 0) {
+    // The length first, then the rest of the record.
+    uint32_t want = 4, n;
+
+    if (p->have >= 4) {
+      memcpy(&want, p->rec, 4);
+      want = ntohl(want);
+      CHECK(want >= REC_HDR && want <= MAX_RECORD, "record length %u", want);
+    }
+    n = want - p->have < len ? want - p->have : len;
+    memcpy(p->rec + p->have, buf, n);
+    p->have += n;
+    buf += n;
+    len -= n;
+    if (p->have == want && want > 4) {
+      check_record(p->rec, p->have, p->next, NULL);
+      p->records++;
+      p->have = 0;
+    }
+  }
+}
+
+/*
+ * Send ring: writers alternate between `ut_write` and a `ut_writev` that
+ * splits the record, which must still arrive in one piece.
+ */
+static void* send_writer(void* arg) {
+  uint32_t writer = (uintptr_t)arg;
+  uint8_t rec[MAX_RECORD];
+
+  for (uint32_t i = 0; i < per_writer; i++) {
+    uint32_t len = build_record(rec, writer, i);
+
+    if (i % 2 == 0) {
+      CHECK(ut_write(sock, rec, len) == 0, "ut_write");
+    } else {
+      struct iovec iov[2] = {{rec, REC_HDR}, {rec + REC_HDR, len - REC_HDR}};
+      CHECK(ut_writev(sock, iov, 2) == 0, "ut_writev");
+    }
+  }
+  return NULL;
+}
+
+static void* send_backend(void* arg) {
+  parser_t* p = arg;
+  uint8_t buf[4096];
+
+  while (p->records < (uint64_t)WRITERS * per_writer) {
+    uint32_t seq = sock->sending_seq;
+    uint32_t end = atomic_load_explicit(&sock->send_win.last_write,
+                                        memory_order_acquire);
+    uint32_t want = end - seq < sizeof(buf) ? end - seq : sizeof(buf);
+    int n;
+
+    if (want == 0) {
+      sched_yield();
+      continue;
+    }
+    n = ut_send_fetch(sock, seq, buf, want);
+    CHECK(n == (int)want, "ut_send_fetch gave %d of %u published bytes", n,
+          want);
+    parse(p, buf, n);
+    sock->send_win.last_sent = seq + n - 1;
+    ut_send_release(sock, seq + n);
+  }
+  return NULL;
+}
+
+static void test_send_ring(void) {
+  pthread_t writers[WRITERS], backend;
+  parser_t* p = calloc(1, sizeof(parser_t));
+
+  CHECK(p != NULL, "out of memory");
+  pthread_create(&backend, NULL, send_backend, p);
+  for (uintptr_t w = 0; w < WRITERS; w++) {
+    pthread_create(&writers[w], NULL, send_writer, (void*)w);
+  }
+  for (int w = 0; w < WRITERS; w++) {
+    pthread_join(writers[w], NULL);
+  }
+  pthread_join(backend, NULL);
+  for (int w = 0; w < WRITERS; w++) {
+    CHECK(p->next[w] == per_writer, "writer %d: %u records arrived", w,
+          p->next[w]);
+  }
+  printf("send ring: %llu records from %d writers\n",
+         (unsigned long long)p->records, WRITERS);
+  free(p);
+}
+
+/*
+ * A vector longer than INT_MAX in total is refused before anything is
+ * written; its buffers are never read.
+ */
+static void test_oversized_writev(void) {
+  uint8_t byte = 0;
+  uint32_t head = atomic_load(&sock->sending_head);
+  struct iovec iov[2] = {{&byte, (size_t)INT_MAX / 2 + 1},
+                         {&byte, (size_t)INT_MAX / 2 + 1}};
+  struct iovec huge = {&byte, ((size_t)1 << 32) + 1};
+
+  CHECK(ut_writev(sock, iov, 2) < 0, "vector over INT_MAX accepted");
+  CHECK(ut_writev(sock, &huge, 1) < 0, "4 GiB + 1 byte vector accepted");
+  CHECK(atomic_load(&sock->sending_head) == head,
+        "refused vector wrote to the ring");
+}
+
+/*
+ * Receive ring: the backend stores the records of every writer in turn, in
+ * pieces of random size, as if they had arrived from the network. With
+ * `as_msgs`, each record goes out as a message.
+ */
+static void* recv_backend(void* arg) {
+  int as_msgs = (uintptr_t)arg;
+  uint8_t rec[MAX_RECORD + UT_MSG_HDR_LEN];
+  uint64_t rng = seed;
+  uint32_t next_expect =
+      atomic_load_explicit(&sock->recv_win.next_expect, memory_order_relaxed);
+
+  for (uint32_t i = 0; i < per_writer; i++) {
+    for (uint32_t w = 0; w < WRITERS; w++) {
+      uint8_t* start = rec + UT_MSG_HDR_LEN;
+      uint32_t len = build_record(start, w, i);
+
+      if (as_msgs) {
+        uint32_t prefix = htonl(len);
+        start = rec;
+        memcpy(start, &prefix, UT_MSG_HDR_LEN);
+        len += UT_MSG_HDR_LEN;
+      }
+      for (uint32_t off = 0; off < len;) {
+        uint32_t piece = 1 + (rng = mix(rng + 1)) % 1500;
+        uint32_t stored;
+
+        if (piece > len - off) {
+          piece = len - off;
+        }
+        stored = ut_recv_store(sock, next_expect, start + off, piece);
+        if (stored == 0) {
+          sched_yield();
+          continue;
+        }
+        off += stored;
+        next_expect += stored;
+        ut_recv_publish(sock, next_expect);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void* msg_reader(void* arg) {
+  uint8_t* seen = arg;
+  uint8_t rec[MAX_RECORD];
+
+  while (!atomic_load(&done)) {
+    int n = ut_recv_msg(sock, rec, sizeof(rec), NO_WAIT);
+    CHECK(n >= 0, "ut_recv_msg");
+    if (n == 0) {
+      sched_yield();
+      continue;
+    }
+    check_record(rec, n, NULL, seen);
+  }
+  return NULL;
+}
+
+static void test_recv_ring(void) {
+  pthread_t backend, readers[READERS];
+  parser_t* p = calloc(1, sizeof(parser_t));
+  uint8_t* seen = calloc(WRITERS * per_writer, 1);
+  uint8_t buf[5000];
+  uint64_t count = 0;
+
+  CHECK(p != NULL && seen != NULL, "out of memory");
+
+  // One reader that blocks, so the sleep/wake handshake is exercised.
+  pthread_create(&backend, NULL, recv_backend, (void*)0);
+  while (p->records < (uint64_t)WRITERS * per_writer) {
+    int n = ut_read(sock, buf, 1 + mix(count++) % sizeof(buf), NO_FLAG);
+    CHECK(n > 0, "ut_read returned %d", n);
+    parse(p, buf, n);
+  }
+  pthread_join(backend, NULL);
+
+  // Several readers taking whole messages.
+  atomic_store(&done, 0);
+  for (int r = 0; r < READERS; r++) {
+    pthread_create(&readers[r], NULL, msg_reader, seen);
+  }
+  pthread_create(&backend, NULL, recv_backend, (void*)1);
+  pthread_join(backend, NULL);
+  while (atomic_load(&sock->recv_win.next_expect) -
+             atomic_load(&sock->recv_win.last_read) - 1 > 0) {
+    sched_yield();
+  }
+  atomic_store(&done, 1);
+  for (int r = 0; r < READERS; r++) {
+    pthread_join(readers[r], NULL);
+  }
+  for (uint32_t i = 0; i < WRITERS * per_writer; i++) {
+    CHECK(seen[i], "message %u/%u never read", i / per_writer, i % per_writer);
+  }
+  printf("receive ring: %llu records read, %u messages by %d readers\n",
+         (unsigned long long)p->records, WRITERS * per_writer, READERS);
+  free(p);
+  free(seen);
+}
+
+/*
+ * Streams: writers share one stream. Records are smaller than the stream's
+ * ring, so none may be torn.
+ */
+static void* stream_writer(void* arg) {
+  uint32_t writer = (uintptr_t)arg;
+  uint8_t rec[MAX_RECORD];
+
+  for (uint32_t i = 0; i < per_writer; i++) {
+    uint32_t len = build_record(rec, writer, i);
+    CHECK(ut_stream_write(sock, 1, rec, len) == 0, "ut_stream_write");
+  }
+  return NULL;
+}
+
+static void test_stream_writers(void) {
+  pthread_t writers[WRITERS];
+  parser_t* p = calloc(1, sizeof(parser_t));
+  uint8_t seg[1400];
+  uint32_t expect_off = 0;
+
+  CHECK(p != NULL, "out of memory");
+  for (uintptr_t w = 0; w < WRITERS; w++) {
+    pthread_create(&writers[w], NULL, stream_writer, (void*)w);
+  }
+  while (p->records < (uint64_t)WRITERS * per_writer) {
+    uint16_t id;
+    uint32_t off, n;
+
+    pthread_mutex_lock(&(sock->send_lock));
+    n = ut_stream_next(sock, sizeof(seg), &id, &off, seg);
+    if (n > 0) {
+      CHECK(id == 1 && off == expect_off, "segment of stream %u at %u", id,
+            off);
+      ut_stream_ack(sock, id, off + n, sock->opts.recv_buf);
+    }
+    pthread_mutex_unlock(&(sock->send_lock));
+    if (n == 0) {
+      sched_yield();
+      continue;
+    }
+    expect_off += n;
+    parse(p, seg, n);
+  }
+  for (int w = 0; w < WRITERS; w++) {
+    pthread_join(writers[w], NULL);
+  }
+  printf("stream: %llu records from %d writers\n",
+         (unsigned long long)p->records, WRITERS);
+  free(p);
+}
+
+int main(int argc, char** argv) {
+  per_writer = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+  seed = argc > 2 ? strtoull(argv[2], NULL, 10) : (uint64_t)time(NULL);
+  printf("ring_stress: %u records per writer, seed %llu\n", per_writer,
+         (unsigned long long)seed);
+
+  sock = aligned_alloc(UT_CACHELINE, sizeof(ut_socket_t));
+  CHECK(sock != NULL, "out of memory");
+  CHECK(ut_socket(sock, TCP_LISTENER, 0, NULL) == 0, "ut_socket");
+  pthread_join(sock->thread_id, NULL);
+
+  test_send_ring();
+  test_oversized_writev();
+  test_recv_ring();
+  test_stream_writers();
+
+  ut_free_state(sock);
+  free(sock);
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
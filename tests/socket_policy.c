@@ -0,0 +1,205 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+/*
+ * Unit tests for the socket's policies, run single-threaded on one socket
+ * at a time:
+ *  - a message too large for the receive buffer is refused by
+ *    `ut_send_msg` and skipped by `ut_recv_msg`;
+ *  - the immediate and delayed ACK policies acknowledge data when they
+ *    should;
+ *  - acknowledged data grows the congestion window, acknowledgements of
+ *    data never sent are ignored, and the third duplicate ACK is a loss;
+ *  - environment variables outside the accepted range fall back to their
+ *    defaults.
+ *
+ * Runs without the network backend: `begin_backend` is stubbed out by
+ * backend_stub.c.
+ *
+ * Usage: socket_policy
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "test_util.h"
+#include "ut_stream.h"
+#include "ut_tcp.h"
+
+#define CHUNK 8192
+
+/*
+ * Stores `len` bytes at `*seq` in the receive ring and publishes them, as the
+ * backend does for an in-order segment.
+ */
+static void put_in_order(ut_socket_t* sock, uint32_t* seq, const void* buf,
+                         uint32_t len) {
+  CHECK(ut_recv_store(sock, *seq, buf, len) == len, "ring full at %u", *seq);
+  *seq += len;
+  ut_recv_publish(sock, *seq);
+}
+
+/*
+ * Sends a message whose prefix exceeds the receive buffer, then a valid one.
+ * The first read must fail, the body must be dropped as it arrives, and the
+ * valid message must come through after it.
+ */
+static void check_msg_skip(void) {
+  static uint8_t chunk[CHUNK];
+  uint8_t out[16];
+  ut_socket_t sock;
+  uint32_t seq = 1, body, prefix, n;
+
+  CHECK(ut_socket(&sock, TCP_LISTENER, 0, NULL) == 0, "ut_socket");
+  pthread_join(sock.thread_id, NULL);
+  CHECK(ut_send_msg(&sock, chunk, sock.opts.recv_buf) < 0,
+        "ut_send_msg took a message larger than the receive buffer");
+
+  body = sock.opts.recv_buf;
+  prefix = htonl(body);
+  put_in_order(&sock, &seq, &prefix, UT_MSG_HDR_LEN);
+  CHECK(ut_recv_msg(&sock, out, sizeof(out), NO_WAIT) < 0,
+        "oversized message not reported");
+  for (; body > 0; body -= n) {
+    n = body < sizeof(chunk) ? body : sizeof(chunk);
+    put_in_order(&sock, &seq, chunk, n);
+    CHECK(ut_recv_msg(&sock, out, sizeof(out), NO_WAIT) == 0,
+          "read into a skipped message");
+  }
+  prefix = htonl(5);
+  put_in_order(&sock, &seq, &prefix, UT_MSG_HDR_LEN);
+  put_in_order(&sock, &seq, "hello", 5);
+  CHECK(ut_recv_msg(&sock, out, sizeof(out), NO_WAIT) == 5 &&
+            memcmp(out, "hello", 5) == 0,
+        "message after a skipped one lost");
+
+  ut_free_state(&sock);
+  close(sock.socket);
+}
+
+/*
+ * Checks when each ACK policy acknowledges data.
+ */
+static void check_ack_policy(void) {
+  ut_socket_t sock = {.opts = {.ack_policy = UT_ACK_IMMEDIATE, .ack_delay = 20}};
+
+  CHECK(ut_ack_on_data(&sock, true), "immediate policy held an ACK");
+  sock.opts.ack_policy = UT_ACK_DELAYED;
+  CHECK(!ut_ack_on_data(&sock, true) && !ut_ack_timer_due(&sock),
+        "first in-order segment not held");
+  CHECK(ut_ack_on_data(&sock, true), "second in-order segment held");
+  ut_ack_sent(&sock);
+  CHECK(ut_ack_on_data(&sock, false), "out-of-order segment held");
+  ut_ack_sent(&sock);
+  CHECK(!ut_ack_on_data(&sock, true), "in-order segment not held");
+  usleep(30 * 1000);
+  CHECK(ut_ack_timer_due(&sock), "held ACK not due after ack_delay");
+  ut_ack_sent(&sock);
+  CHECK(!ut_ack_timer_due(&sock), "ACK still due after it was sent");
+}
+
+/*
+ * Checks that releasing acknowledged data grows the window in slow start,
+ * that acknowledgements of data never sent are ignored, and that the third
+ * duplicate ACK reports a loss.
+ */
+static void check_cc_hooks(void) {
+  ut_socket_t sock;
+  uint8_t buf[100] = {0};
+  uint16_t id;
+  uint32_t win, seq, off;
+
+  CHECK(ut_socket(&sock, TCP_LISTENER, 0, NULL) == 0, "ut_socket");
+  pthread_join(sock.thread_id, NULL);
+  win = sock.cong_win;
+  sock.slow_start_thresh = 100 * win;
+  sock.send_win.last_sent = sock.sending_seq + 199;
+  ut_send_release(&sock, sock.sending_seq + 100);
+  CHECK(sock.cong_win == win + 100, "window %u after 100 bytes acked from %u",
+        sock.cong_win, win);
+  seq = sock.sending_seq;
+  ut_send_release(&sock, sock.send_win.last_sent + 2);
+  CHECK(sock.sending_seq == seq && sock.cong_win == win + 100,
+        "ACK past the last byte sent released data");
+
+  win = sock.cong_win;
+  CHECK(ut_stream_write(&sock, 1, buf, sizeof(buf)) == 0, "ut_stream_write");
+  ut_stream_ack(&sock, 1, 10, sock.opts.recv_buf);
+  CHECK(sock.cong_win == win, "stream ACK of written but unsent data taken");
+  CHECK(ut_stream_next(&sock, 40, &id, &off, buf) == 40, "ut_stream_next");
+  ut_stream_ack(&sock, 1, 41, sock.opts.recv_buf);
+  CHECK(sock.cong_win == win, "stream ACK past the data sent taken");
+  // Data sent before a rewind may still be acknowledged.
+  ut_stream_rewind(&sock);
+  ut_stream_ack(&sock, 1, 40, sock.opts.recv_buf);
+  CHECK(sock.cong_win == win + 40, "stream ACK after a rewind not taken");
+  win = sock.cong_win = 20 * ut_mss(&sock);
+  for (uint32_t i = 1; i < UT_DUP_ACK_THRESHOLD; i++) {
+    CHECK(!ut_send_dup_ack(&sock), "loss after %u duplicate ACKs", i);
+  }
+  CHECK(ut_send_dup_ack(&sock), "no loss after %u duplicate ACKs",
+        UT_DUP_ACK_THRESHOLD);
+  CHECK(sock.cong_win < win, "window %u not reduced", sock.cong_win);
+
+  ut_free_state(&sock);
+  close(sock.socket);
+}
+
+/*
+ * Checks that an environment variable outside the range `ut_socket_ex`
+ * accepts falls back to its default instead of breaking every socket.
+ */
+static void check_opts_env(void) {
+  const char* bad[][2] = {
+      {"UT_TCP_MTU", "100"},        {"UT_TCP_MAX_MTU", "100000"},
+      {"UT_TCP_RECV_BUF", "100"},   {"UT_TCP_SEND_BUF", "0"},
+      {"UT_TCP_RTO_MIN", "0"},      {"UT_TCP_RTO_MAX", "1"},
+  };
+  int n = sizeof(bad) / sizeof(bad[0]);
+  ut_socket_opts_t def, opts;
+  ut_socket_t sock;
+
+  ut_socket_opts_init(&def);
+  for (int i = 0; i < n; i++) {
+    setenv(bad[i][0], bad[i][1], 1);
+  }
+  ut_socket_opts_init(&opts);
+  CHECK(opts.mtu == def.mtu && opts.max_mtu == def.max_mtu &&
+            opts.recv_buf == def.recv_buf && opts.send_buf == def.send_buf &&
+            opts.rto_min == def.rto_min && opts.rto_max == def.rto_max,
+        "out-of-range variables not ignored");
+  CHECK(ut_socket(&sock, TCP_LISTENER, 0, NULL) == 0,
+        "ut_socket failed with out-of-range variables");
+  pthread_join(sock.thread_id, NULL);
+  ut_free_state(&sock);
+  close(sock.socket);
+
+  // Without probing, a buffer smaller than a jumbo packet is fine.
+  setenv("UT_TCP_RECV_BUF", "4096", 1);
+  ut_socket_opts_init(&opts);
+  CHECK(opts.recv_buf == 4096, "recv_buf %u, expected 4096", opts.recv_buf);
+  CHECK(ut_socket(&sock, TCP_LISTENER, 0, NULL) == 0,
+        "ut_socket failed with a 4096-byte receive buffer");
+  pthread_join(sock.thread_id, NULL);
+  ut_free_state(&sock);
+  close(sock.socket);
+  for (int i = 0; i < n; i++) {
+    unsetenv(bad[i][0]);
+  }
+}
+
+int main(void) {
+  check_msg_skip();
+  check_ack_policy();
+  check_cc_hooks();
+  check_opts_env();
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
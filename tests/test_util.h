@@ -0,0 +1,26 @@
+/**
+ * Copyright (C) 2022 Carnegie Mellon University
+ * Copyright (C) 2025 University of Texas at Austin
+ */
+
+#ifndef UTCS356_ASSN4_TESTS_TEST_UTIL_H_
+#define UTCS356_ASSN4_TESTS_TEST_UTIL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Fails the test, reporting where and a printf-style message, unless `cond`
+ * holds.
+ */
+#define CHECK(cond, ...)                                   \
+  do {                                                     \
+    if (!(cond)) {                                         \
+      fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__);                        \
+      fprintf(stderr, "\n");                               \
+      exit(EXIT_FAILURE);                                  \
+    }                                                      \
+  } while (0)
+
+#endif  // UTCS356_ASSN4_TESTS_TEST_UTIL_H_
@@ -3,19 +3,22 @@
  * Copyright (C) 2025 University of Texas at Austin
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "ut_tcp.h"
 
 #define BUF_SIZE 16000
+#define CLOSE_LINGER 30000  // ms
 
 void functionality(ut_socket_t *sock) {
   uint8_t buf[BUF_SIZE];
-  FILE *fp;
+  struct stat st;
+  int fd;
   int n;
-  int read;
 
   n = 0;
   while (n == 0) {
@@ -24,12 +27,13 @@ void functionality(ut_socket_t *sock) {
   printf("Read %d bytes\n", n);
 
   // Send over a random file
-  fp = fopen("tests/random.input", "rb");
-  read = 1;
-  while (read > 0) {
-    read = fread(buf, 1, 2000, fp);
-    if (read > 0) ut_write(sock, buf, read);
+  fd = open("tests/random.input", O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror("Error opening file");
+    exit(EXIT_FAILURE);
   }
+  ut_sendfile(sock, fd, 0, st.st_size);
+  close(fd);
 }
 
 int main(int argc, char **argv) {
@@ -51,6 +55,7 @@ int main(int argc, char **argv) {
   sleep(1);
   functionality(&socket);
 
+  ut_set_linger(&socket, CLOSE_LINGER);
   if (ut_close(&socket) < 0) {
     exit(EXIT_FAILURE);
   }